@@ -1,4 +1,121 @@
+#include <algorithm>
 #include "Arduino.h"
+#include "binaryProtocol.h"
 
 // Static instance
-SerialComm SerialComm::com0;
\ No newline at end of file
+SerialComm SerialComm::com0;
+
+namespace
+{
+	struct Frame
+	{
+		size_t size;
+		bool endOfProgram;
+	};
+
+	// Binary frame starting at data[pos]. Its size includes any stray bytes before the sync byte
+	Frame scanFrame(const std::vector<uint8_t>& data, size_t pos)
+	{
+		size_t end = pos;
+		while (end < data.size() && data[end] != binaryProtocol::kSync)
+			++end;
+		end += 2; // Sync and code
+		if (end >= data.size())
+			return { data.size() - pos, true };
+		const uint8_t code = data[end - 1];
+		uint8_t mask = data[end++] & 0xf; // Argument mask in the header
+		if (binaryProtocol::hasExtendedArguments(code) && end < data.size())
+			mask |= uint8_t(data[end++] << 4);
+		for (int i = 0; i < 8; ++i)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+			while (end < data.size() && (data[end] & 0x80))
+				++end;
+			++end;
+		}
+		end += 2; // Crc
+		return { min(end, data.size()) - pos, code == binaryProtocol::kEndOfProgram };
+	}
+}
+
+void SerialComm::InitFromFile(const std::string& filePath)
+{
+	std::ifstream file(filePath, std::ios::binary);
+	m_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+	// Split the program into the units the firmware acknowledges. Lines outside of a program get no reply.
+	bool inProgram = false;
+	bool binary = false;
+	for (size_t pos = 0; pos < m_data.size();)
+	{
+		if (binary)
+		{
+			const Frame frame = scanFrame(m_data, pos);
+			binary = inProgram = !frame.endOfProgram;
+			m_units.push_back({ frame.size, true });
+			pos += frame.size;
+			continue;
+		}
+
+		auto end = std::find(m_data.begin() + pos, m_data.end(), '\n');
+		const size_t size = (end == m_data.end() ? end : end + 1) - (m_data.begin() + pos);
+		const bool startsProgram = !inProgram && m_data[pos] == '%';
+		const bool acknowledged = inProgram || startsProgram;
+		if (startsProgram)
+			binary = size > 1 && m_data[pos + 1] == 'B';
+		inProgram = startsProgram || (inProgram && m_data[pos] != '%');
+		m_units.push_back({ size, acknowledged });
+		pos += size;
+	}
+
+	sitl::serialRxSource = [] { return com0.nextByte(); };
+	sitl::serialTxObserver = [](uint8_t c) { com0.onFirmwareOutput(c); };
+}
+
+int SerialComm::nextByte()
+{
+	if (m_pos == m_data.size())
+		return -1;
+
+	if (m_unitLeft == 0)
+	{
+		// Wait until the whole unit fits in the RX buffer. A unit larger than the buffer is sent alone.
+		const Unit& unit = m_units.front();
+		if (!m_capacity || (!m_inFlight.empty() && m_inFlightBytes + unit.size > m_capacity))
+			return -1;
+		if (unit.acknowledged)
+		{
+			m_inFlight.push_back(unit.size);
+			m_inFlightBytes += unit.size;
+		}
+		m_unitLeft = unit.size;
+		// Echo whole lines, so they don't mix with the firmware output that comes back meanwhile
+		std::cout.write(reinterpret_cast<const char*>(&m_data[m_pos]), std::streamsize(unit.size));
+		m_units.pop_front();
+	}
+
+	--m_unitLeft;
+	return m_data[m_pos++];
+}
+
+void SerialComm::onFirmwareOutput(uint8_t c)
+{
+	if (c != '\n')
+	{
+		if (c != '\r')
+			m_outputLine.push_back(char(c));
+		return;
+	}
+
+	std::cout << m_outputLine << '\n';
+	const std::string ready = "ready rx:";
+	if (m_outputLine.rfind(ready, 0) == 0)
+		m_capacity = std::stoul(m_outputLine.substr(ready.size()));
+	else if ((m_outputLine == "ok" || m_outputLine == "error" || m_outputLine.rfind("resend", 0) == 0) && !m_inFlight.empty())
+	{
+		m_inFlightBytes -= m_inFlight.front();
+		m_inFlight.pop_front();
+	}
+	m_outputLine.clear();
+}
@@ -3,7 +3,12 @@
 #include <iostream>
 #include <chrono>
 #include <thread>
+#include <deque>
 #include <fstream>
+#include <string>
+#include <vector>
+#include <math.h>
+#include "avrEmulation.h"
 
 // Arduino mega pin definitions
 #define NUM_DIGITAL_PINS            70
@@ -64,6 +69,10 @@ static const uint8_t A14 = PIN_A14;
 static const uint8_t A15 = PIN_A15;
 
 // Common Arduino Macros
+// Program memory is the same as data memory
+#define PROGMEM
+#define pgm_read_word(address) (*(const uint16_t*)(address))
+
 #define HIGH 0x1
 #define LOW  0x0
 
@@ -75,49 +84,69 @@ static const uint8_t A15 = PIN_A15;
 #define max(a,b) ((a)>(b)?(a):(b))
 #define abs(x) ((x)>0?(x):-(x))
 
+// Host side of the serial link. Streams a program to the firmware with character counting: Sends lines
+// (or binary frames) as long as the bytes of those not acknowledged yet fit in the RX buffer capacity
+// advertised by the firmware, and frees them as the replies come back.
 struct SerialComm
 {
-	void begin(unsigned baudrate) {}
-	template<class T>
-	void print(T x) { std::cout << x; }
-	template<class T>
-	void println(T x) { std::cout << x << "\n"; }
-
-	void InitFromFile(const std::string& filePath)
-	{
-		m_file.open(filePath);
-	}
+	void InitFromFile(const std::string& filePath);
 
-	int available()
-	{
-		return (m_file.is_open() && !m_file.eof())? 1 : 0;
-	}
-
-	size_t readBytes(char* buffer, size_t length)
-	{
-		m_file.read(buffer, length);
-		std::cout << std::string(buffer, length);
-		return length;
-	}
+	int nextByte();
+	void onFirmwareOutput(uint8_t c);
+	// The whole program was sent, and the firmware replied to every line that expects it
+	bool done() const { return !m_data.empty() && m_pos == m_data.size() && m_inFlight.empty(); }
 
 	static SerialComm com0;
 
 private:
-	std::ifstream m_file;
+	struct Unit
+	{
+		size_t size;
+		bool acknowledged; // The firmware replies to it
+	};
+
+	std::vector<uint8_t> m_data;
+	size_t m_pos = 0;
+	std::deque<Unit> m_units; // Not sent yet
+	size_t m_unitLeft = 0; // Bytes left to send of the current unit
+	std::deque<size_t> m_inFlight; // Sizes of the units waiting for a reply
+	size_t m_inFlightBytes = 0;
+	size_t m_capacity = 0; // Unknown until the firmware is ready
+	std::string m_outputLine;
 };
 
+inline unsigned long micros()
+{
+	// Wrap around at 32 bits, like the atmega does
+	return uint32_t(sitl::cpuCycles() / (F_CPU / 1'000'000));
+}
+
+inline unsigned long millis()
+{
+	return uint32_t(sitl::cpuCycles() / (F_CPU / 1'000));
+}
+
+inline void noInterrupts() { cli(); }
+inline void interrupts() { sei(); }
+
 inline void delay(unsigned long ms)
 {
+#ifdef MOCK_CLOCK
+	sitl::spendCycles(uint64_t(ms) * (F_CPU / 1'000));
+#else
 	auto sleepTime = std::chrono::milliseconds(ms);
-	std::this_thread::sleep_for(sleepTime);
+	auto t0 = std::chrono::steady_clock::now();
+	while (std::chrono::steady_clock::now() - t0 < sleepTime)
+	{
+		sitl::serviceInterrupts();
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+#endif
 }
 
 inline void delayMicroseconds(unsigned int us)
 {
-	auto sleepTime = std::chrono::microseconds(us);
-	auto t0 = std::chrono::steady_clock::now();
-	while(std::chrono::steady_clock::now() - t0 < sleepTime)
-	{ }
+	sitl::spendCycles(uint64_t(us) * (F_CPU / 1'000'000));
 }
 
 inline void pinMode(uint8_t pin, uint8_t mode)
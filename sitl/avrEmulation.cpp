@@ -0,0 +1,310 @@
+#include "avrEmulation.h"
+#include <algorithm>
+#include <iostream>
+#include "stepTrace.h"
+
+namespace sitl
+{
+	InterruptHandler interruptVectors[kNumVectors] = {};
+	bool interruptsEnabled = true;
+
+	namespace
+	{
+		uint64_t timer1LastUpdate = 0;
+		uint64_t usart0LastByte = 0;
+		uint64_t usart0TxReadyAt = 0;
+
+		void raise(InterruptVector vector)
+		{
+			// The hardware clears the global interrupt flag while running a handler
+			interruptsEnabled = false;
+			if (interruptVectors[vector])
+				interruptVectors[vector]();
+			interruptsEnabled = true;
+		}
+
+		// Flag the external and pin change interrupts of an input pin that changed
+		void inputChanged(char port, uint8_t mask, bool rising)
+		{
+			for (int bit = 0; bit < 8; ++bit)
+			{
+				if (!(mask & (1 << bit)))
+					continue;
+
+				// INT0-3 on PD0-3 and INT4-7 on PE4-7. Sense control: 0 low level, 1 change, 2 falling, 3 rising
+				const int n = (port == 'D' && bit < 4) || (port == 'E' && bit >= 4) ? bit : -1;
+				if (n >= 0)
+				{
+					const uint8_t sense = ((n < 4 ? EICRA : EICRB) >> (2 * (n % 4))) & 3;
+					if (sense == 1 || (sense == 3 && rising) || ((sense == 2 || sense == 0) && !rising))
+						EIFR.flags |= (1 << n);
+				}
+
+				// PCINT0-7 on PB0-7, PCINT8 on PE0, PCINT9-15 on PJ0-6 and PCINT16-23 on PK0-7
+				int group = -1;
+				int groupBit = bit;
+				if (port == 'B')
+					group = 0;
+				else if (port == 'E' && bit == 0)
+					group = 1;
+				else if (port == 'J' && bit < 7)
+				{
+					group = 1;
+					groupBit = bit + 1;
+				}
+				else if (port == 'K')
+					group = 2;
+				const uint8_t pinChangeMasks[] = { PCMSK0, PCMSK1, PCMSK2 };
+				if (group >= 0 && (pinChangeMasks[group] & (1 << groupBit)))
+					PCIFR.flags |= (1 << group);
+			}
+		}
+
+		uint32_t timer1Prescaler()
+		{
+			constexpr uint32_t prescalers[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+			return prescalers[TCCR1B & 0x7];
+		}
+
+		void compareMatch(uint8_t flag, uint8_t enable, InterruptVector vector)
+		{
+			TIFR1.flags |= (1 << flag);
+			// Run the handler right away so that it can reprogram the timer before the next match
+			if (interruptsEnabled && (TIMSK1 & (1 << enable)))
+			{
+				TIFR1 = (1 << flag);
+				raise(vector);
+			}
+		}
+
+		// Timer 1 in CTC mode: Count up to OCR1A, flag the compare match and restart from 0.
+		// Compare match B is flagged on the way whenever the counter reaches OCR1B.
+		void updateTimer1(uint64_t now)
+		{
+			uint64_t& lastUpdate = timer1LastUpdate;
+			const uint32_t prescaler = timer1Prescaler();
+			if (!prescaler) // Timer stopped
+			{
+				lastUpdate = now;
+				return;
+			}
+
+			uint64_t ticks = (now - lastUpdate) / prescaler;
+			lastUpdate += ticks * prescaler;
+			while (ticks > 0)
+			{
+				const bool ctc = TCCR1B & (1 << WGM12);
+				const uint32_t top = ctc ? OCR1A : 0xffff;
+				const uint32_t ticksToMatch = (TCNT1 <= top ? top - TCNT1 : 0x10000 - TCNT1 + top) + 1;
+				const uint32_t ticksToMatchB = (OCR1B > TCNT1 && OCR1B <= top) ? OCR1B - TCNT1 : ticksToMatch;
+				if (ticksToMatchB < ticksToMatch && ticksToMatchB <= ticks)
+				{
+					ticks -= ticksToMatchB;
+					TCNT1 = OCR1B;
+					compareMatch(OCF1B, OCIE1B, TIMER1_COMPB_vect_num);
+					continue;
+				}
+				if (ticks < ticksToMatch)
+				{
+					TCNT1 += uint16_t(ticks);
+					break;
+				}
+				ticks -= ticksToMatch;
+				TCNT1 = 0;
+				compareMatch(OCF1A, OCIE1A, TIMER1_COMPA_vect_num);
+			}
+		}
+
+		// Deliver bytes from serialRxSource at the baud rate. A byte waits in UDR0 until it is read, instead of
+		// being overrun by the next one, so the source is simply paused while interrupts are disabled.
+		uint64_t usart0CyclesPerByte()
+		{
+			const uint64_t cyclesPerBit = ((UCSR0A & (1 << U2X0)) ? 8 : 16) * (uint64_t(UBRR0) + 1);
+			return 10 * cyclesPerBit; // Start, 8 data bits and stop
+		}
+
+		void updateUsart0(uint64_t now)
+		{
+			uint64_t& lastByte = usart0LastByte;
+			if (!serialRxSource || !(UCSR0B & (1 << RXEN0)) || (UCSR0A & (1 << RXC0)))
+			{
+				lastByte = now;
+				return;
+			}
+
+			const uint64_t cyclesPerByte = usart0CyclesPerByte();
+			while (now - lastByte >= cyclesPerByte)
+			{
+				lastByte += cyclesPerByte;
+				const int c = serialRxSource();
+				if (c < 0)
+				{
+					lastByte = now;
+					return;
+				}
+				UDR0.received = uint8_t(c);
+				UCSR0A.flags |= (1 << RXC0);
+				if (!interruptsEnabled || !(UCSR0B & (1 << RXCIE0)))
+					return;
+				raise(USART0_RX_vect_num);
+			}
+		}
+
+		// Cycle of the next timer 1 compare match or USART0 byte sent or received, if any comes before end
+		uint64_t nextEvent(uint64_t end)
+		{
+			const uint32_t prescaler = timer1Prescaler();
+			if (prescaler)
+			{
+				const bool ctc = TCCR1B & (1 << WGM12);
+				const uint32_t top = ctc ? OCR1A : 0xffff;
+				uint32_t ticks = (TCNT1 <= top ? top - TCNT1 : 0x10000 - TCNT1 + top) + 1;
+				if (OCR1B > TCNT1 && OCR1B <= top)
+					ticks = std::min(ticks, uint32_t(OCR1B - TCNT1));
+				end = std::min(end, timer1LastUpdate + uint64_t(ticks) * prescaler);
+			}
+			if (serialRxSource && (UCSR0B & (1 << RXEN0)) && !(UCSR0A & (1 << RXC0)))
+				end = std::min(end, usart0LastByte + usart0CyclesPerByte());
+			if ((UCSR0B & (1 << UDRIE0)) && !usart0TxReady())
+				end = std::min(end, usart0TxReadyAt);
+			return end;
+		}
+	}
+
+	uint8_t portValue(char name)
+	{
+		PortRegister* const ports[] = { &PORTA, &PORTB, &PORTC, &PORTD, &PORTE, &PORTF, &PORTG, &PORTH, &PORTJ, &PORTK, &PORTL };
+		for (const PortRegister* port : ports)
+		{
+			if (port->name == name)
+				return port->value;
+		}
+		return 0;
+	}
+
+	void simulateAxes(char port, uint8_t oldValue, uint8_t newValue)
+	{
+		const uint8_t risingEdges = newValue & ~oldValue;
+		for (size_t i = 0; i < simulatedAxes.size(); ++i)
+		{
+			SimulatedAxis& axis = simulatedAxes[i];
+			if (axis.stepPort != port || !(risingEdges & axis.stepMask))
+				continue;
+			const uint8_t dir = axis.dirPort == port ? newValue : portValue(axis.dirPort);
+			const bool forward = dir & axis.dirMask;
+#ifdef STEP_TRACE
+			stepTrace::record(cpuCycles(), uint8_t(i), forward);
+#endif
+			const bool wasTriggered = axis.position <= 0;
+			axis.position += forward ? 1 : -1;
+			const bool triggered = axis.position <= 0;
+			const bool pulse = !triggered && !wasTriggered && axis.position == axis.eventAt; // Injected endstop event
+#ifdef STEP_TRACE
+			if ((triggered && !wasTriggered) || pulse)
+				stepTrace::recordEndstop(cpuCycles(), uint8_t(i));
+#endif
+			if (triggered != wasTriggered)
+				inputChanged(axis.endstopPort, axis.endstopMask, triggered);
+			else if (pulse)
+			{
+				inputChanged(axis.endstopPort, axis.endstopMask, true);
+				inputChanged(axis.endstopPort, axis.endstopMask, false);
+			}
+		}
+	}
+
+	InputRegister::operator uint8_t() const
+	{
+		uint8_t pins = value;
+		for (const SimulatedAxis& axis : simulatedAxes)
+		{
+			if (axis.endstopPort == name && axis.position <= 0)
+				pins |= axis.endstopMask;
+		}
+		return pins;
+	}
+
+	void spendCycles(uint64_t cycles)
+	{
+		const uint64_t end = cpuCycles() + cycles;
+#ifdef MOCK_CLOCK
+		for (;;)
+		{
+			serviceInterrupts();
+			const uint64_t now = cpuCycles();
+			if (now >= end)
+				return;
+			MockClockSrc::currentTime = MockClockSrc::time_point(MockClockSrc::duration(std::max(nextEvent(end), now + 1)));
+		}
+#else
+		do
+		{
+			serviceInterrupts();
+		} while (cpuCycles() < end);
+#endif
+	}
+
+	bool usart0TxReady()
+	{
+		return cpuCycles() >= usart0TxReadyAt;
+	}
+
+	UsartDataRegister& UsartDataRegister::operator=(uint8_t c)
+	{
+		usart0TxReadyAt = cpuCycles() + usart0CyclesPerByte();
+		if (serialTxObserver)
+			serialTxObserver(c);
+		else
+			std::cout.put(char(c));
+		return *this;
+	}
+
+	UsartDataRegister::operator uint8_t()
+	{
+		UCSR0A.flags &= ~(1 << RXC0);
+		return received;
+	}
+
+	void serviceInterrupts()
+	{
+		if (!interruptsEnabled)
+			return;
+
+		// Pending flags raised while interrupts were disabled, in priority order
+		for (int n = 0; n < 8; ++n)
+		{
+			if ((EIFR & (1 << n)) && (EIMSK & (1 << n)))
+			{
+				EIFR = (1 << n);
+				raise(InterruptVector(INT0_vect_num + n));
+			}
+		}
+		for (int group = 0; group < 3; ++group)
+		{
+			if ((PCIFR & (1 << group)) && (PCICR & (1 << group)))
+			{
+				PCIFR = (1 << group);
+				raise(InterruptVector(PCINT0_vect_num + group));
+			}
+		}
+		if ((TIFR1 & (1 << OCF1A)) && (TIMSK1 & (1 << OCIE1A)))
+		{
+			TIFR1 = (1 << OCF1A);
+			raise(TIMER1_COMPA_vect_num);
+		}
+		if ((TIFR1 & (1 << OCF1B)) && (TIMSK1 & (1 << OCIE1B)))
+		{
+			TIFR1 = (1 << OCF1B);
+			raise(TIMER1_COMPB_vect_num);
+		}
+
+		if ((UCSR0A & (1 << RXC0)) && (UCSR0B & (1 << RXCIE0)))
+			raise(USART0_RX_vect_num);
+		if ((UCSR0B & (1 << UDRIE0)) && usart0TxReady())
+			raise(USART0_UDRE_vect_num);
+
+		const uint64_t now = cpuCycles();
+		updateTimer1(now);
+		updateUsart0(now);
+	}
+}
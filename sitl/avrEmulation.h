@@ -0,0 +1,291 @@
+// Emulation of the atmega2560 peripherals used by the firmware
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#ifdef MOCK_CLOCK
+#include "clock.h"
+#endif
+
+#define F_CPU 16000000UL
+
+namespace sitl
+{
+	// Emulated cpu clock cycles since the start of the program.
+	// With MOCK_CLOCK, time is virtual: It follows MockClockSrc, and only moves forward as the firmware
+	// spends cycles (see spendCycles), so runs are deterministic and go as fast as the host can.
+	// Otherwise it follows the wall clock.
+	inline uint64_t cpuCycles()
+	{
+#ifdef MOCK_CLOCK
+		return uint64_t(MockClockSrc::currentTime.time_since_epoch().count());
+#else
+		using implClock = std::chrono::steady_clock;
+		static auto t0 = implClock::now();
+		auto nsFromStart = std::chrono::duration_cast<std::chrono::nanoseconds>(implClock::now() - t0).count();
+		return uint64_t(nsFromStart) * (F_CPU / 1'000'000) / 1000;
+#endif
+	}
+
+	// Interrupt vectors. Handlers are registered by the ISR macro
+	enum InterruptVector : uint8_t
+	{
+		INT0_vect_num,
+		INT1_vect_num,
+		INT2_vect_num,
+		INT3_vect_num,
+		INT4_vect_num,
+		INT5_vect_num,
+		INT6_vect_num,
+		INT7_vect_num,
+		PCINT0_vect_num,
+		PCINT1_vect_num,
+		PCINT2_vect_num,
+		TIMER1_COMPA_vect_num,
+		TIMER1_COMPB_vect_num,
+		USART0_RX_vect_num,
+		USART0_UDRE_vect_num,
+		kNumVectors
+	};
+
+	using InterruptHandler = void(*)();
+	extern InterruptHandler interruptVectors[kNumVectors];
+	extern bool interruptsEnabled;
+
+	struct VectorRegistration
+	{
+		VectorRegistration(InterruptVector vector, InterruptHandler handler)
+		{
+			interruptVectors[vector] = handler;
+		}
+	};
+
+	// Advance the emulated peripherals up to the current time and run any interrupt handlers that
+	// became due since the last call. There is no preemption in the emulation, so this must be called
+	// periodically (it is called every time interrupts are enabled and from the delay functions).
+	void serviceInterrupts();
+
+	// Let the emulated cpu run for the given number of cycles, on work that isn't emulated cycle by cycle,
+	// like busy waits or a pass of the main loop. Virtual time jumps from one peripheral event to the next,
+	// servicing interrupts right when they are due. In real time, this busy waits servicing interrupts.
+	void spendCycles(uint64_t cycles);
+}
+
+#define ISR(vector) \
+	void sitl_isr_##vector(); \
+	static sitl::VectorRegistration sitl_reg_##vector(sitl::vector##_num, sitl_isr_##vector); \
+	void sitl_isr_##vector()
+
+inline void cli() { sitl::interruptsEnabled = false; }
+inline void sei()
+{
+	sitl::interruptsEnabled = true;
+	sitl::serviceInterrupts();
+}
+
+namespace sitl
+{
+	// Interrupt flag registers are cleared by writing a logical one to the flag
+	struct FlagRegister
+	{
+		FlagRegister& operator=(uint8_t clearMask)
+		{
+			flags &= ~clearMask;
+			return *this;
+		}
+
+		operator uint8_t() const { return flags; }
+
+		uint8_t flags = 0;
+	};
+}
+
+// Timer 1 registers
+inline uint8_t TCCR1A;
+inline uint8_t TCCR1B;
+inline uint8_t TIMSK1;
+inline sitl::FlagRegister TIFR1;
+inline uint16_t TCNT1;
+inline uint16_t OCR1A;
+inline uint16_t OCR1B;
+
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define OCIE1A 1
+#define OCIE1B 2
+#define OCF1A 1
+#define OCF1B 2
+
+// External and pin change interrupt registers
+inline uint8_t EICRA;
+inline uint8_t EICRB;
+inline uint8_t EIMSK;
+inline sitl::FlagRegister EIFR;
+inline uint8_t PCICR;
+inline sitl::FlagRegister PCIFR;
+inline uint8_t PCMSK0;
+inline uint8_t PCMSK1;
+inline uint8_t PCMSK2;
+
+namespace sitl
+{
+	struct PortWrite
+	{
+		uint64_t cycle;
+		char port; // 'A' to 'L'
+		uint8_t value;
+	};
+
+	// Called on every write to a port output register, if set. Lets tests and tools record pin activity.
+	inline void (*portWriteObserver)(const PortWrite&) = nullptr;
+
+	// Axis of the simulated machine. Its carriage follows the step and dir pins of the driver, moving
+	// forward on rising step edges while dir is high, and its endstop input reads high while the
+	// carriage is at or behind the endstop. Endstop changes raise the pin interrupts of the input.
+	struct SimulatedAxis
+	{
+		static constexpr int32_t kNoEvent = INT32_MIN;
+
+		char stepPort;
+		uint8_t stepMask;
+		char dirPort;
+		uint8_t dirMask;
+		char endstopPort;
+		uint8_t endstopMask;
+		int32_t position; // Steps from the point where the endstop triggers
+		// The endstop input pulses once when the carriage steps onto this position, to inject a
+		// trigger anywhere along the axis, like a crash or a noisy switch would.
+		int32_t eventAt = kNoEvent;
+	};
+
+	// Axes of the simulated machine. Empty unless set up by the SITL executable or the tests.
+	inline std::vector<SimulatedAxis> simulatedAxes;
+
+	// Move the simulated carriages after a write to an output port
+	void simulateAxes(char port, uint8_t oldValue, uint8_t newValue);
+
+	// Output register of an IO port. Each read-modify-write is reported as a single write.
+	// On virtual time, every write takes the cycles of the read-modify-write sequence on the atmega, so
+	// writes to several ports in a row are as far apart as they would be on the board.
+	struct PortRegister
+	{
+		PortRegister& operator=(uint8_t newValue)
+		{
+#ifdef MOCK_CLOCK
+			// in/or/out for ports A to G, lds/or/sts for H to L, which are outside the IO space
+			const int writeCycles = name < 'H' ? 3 : 5;
+			MockClockSrc::currentTime += MockClockSrc::duration(writeCycles);
+#endif
+			const uint8_t oldValue = value;
+			value = newValue;
+			if (!simulatedAxes.empty())
+				simulateAxes(name, oldValue, newValue);
+			if (portWriteObserver)
+				portWriteObserver({ cpuCycles(), name, newValue });
+			return *this;
+		}
+
+		PortRegister& operator|=(uint8_t mask) { return *this = uint8_t(value | mask); }
+		PortRegister& operator&=(uint8_t mask) { return *this = uint8_t(value & mask); }
+
+		operator uint8_t() const { return value; }
+
+		char name;
+		uint8_t value = 0;
+	};
+
+	// Value of the output register of the port named 'A' to 'L'
+	uint8_t portValue(char name);
+
+	// Input register of an IO port. Reads the endstops of the simulated axes on the port, and value
+	// for the rest of the pins.
+	struct InputRegister
+	{
+		operator uint8_t() const;
+
+		char name;
+		uint8_t value = 0;
+	};
+}
+
+namespace sitl
+{
+	// Source of the bytes arriving at USART0. Returns the next byte, or -1 if there is nothing to send.
+	// Bytes are delivered at the programmed baud rate.
+	inline int (*serialRxSource)() = nullptr;
+	// Called with every byte transmitted by USART0, if set. Otherwise they go to stdout.
+	inline void (*serialTxObserver)(uint8_t) = nullptr;
+
+	// The USART0 data register is free to take another byte. Each byte takes the time of a frame at the
+	// programmed baud rate to send.
+	bool usart0TxReady();
+
+	// USART status register. Flags are read only.
+	struct UsartStatusRegister
+	{
+		static constexpr uint8_t kReadOnly = (1 << 7) | (1 << 6) | (1 << 5) | (1 << 4) | (1 << 3) | (1 << 2);
+
+		UsartStatusRegister& operator=(uint8_t value)
+		{
+			flags = uint8_t((flags & kReadOnly) | (value & ~kReadOnly));
+			return *this;
+		}
+
+		operator uint8_t() const { return flags | (usart0TxReady() ? (1 << 5) : 0); }
+
+		uint8_t flags = 0;
+	};
+
+	// USART data register. Writes transmit to serialTxObserver or stdout, reads return the last received byte.
+	struct UsartDataRegister
+	{
+		UsartDataRegister& operator=(uint8_t c);
+		operator uint8_t();
+
+		uint8_t received = 0;
+	};
+}
+
+// USART0 registers
+inline sitl::UsartStatusRegister UCSR0A;
+inline uint8_t UCSR0B;
+inline uint8_t UCSR0C;
+inline uint16_t UBRR0;
+inline sitl::UsartDataRegister UDR0;
+
+#define RXC0 7
+#define UDRE0 5
+#define U2X0 1
+#define RXCIE0 7
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ01 2
+#define UCSZ00 1
+
+// IO port registers
+inline sitl::PortRegister PORTA{ 'A' };
+inline sitl::PortRegister PORTB{ 'B' };
+inline sitl::PortRegister PORTC{ 'C' };
+inline sitl::PortRegister PORTD{ 'D' };
+inline sitl::PortRegister PORTE{ 'E' };
+inline sitl::PortRegister PORTF{ 'F' };
+inline sitl::PortRegister PORTG{ 'G' };
+inline sitl::PortRegister PORTH{ 'H' };
+inline sitl::PortRegister PORTJ{ 'J' };
+inline sitl::PortRegister PORTK{ 'K' };
+inline sitl::PortRegister PORTL{ 'L' };
+inline uint8_t DDRA, DDRB, DDRC, DDRD, DDRE, DDRF, DDRG, DDRH, DDRJ, DDRK, DDRL;
+inline sitl::InputRegister PINA{ 'A' };
+inline sitl::InputRegister PINB{ 'B' };
+inline sitl::InputRegister PINC{ 'C' };
+inline sitl::InputRegister PIND{ 'D' };
+inline sitl::InputRegister PINE{ 'E' };
+inline sitl::InputRegister PINF{ 'F' };
+inline sitl::InputRegister PING{ 'G' };
+inline sitl::InputRegister PINH{ 'H' };
+inline sitl::InputRegister PINJ{ 'J' };
+inline sitl::InputRegister PINK{ 'K' };
+inline sitl::InputRegister PINL{ 'L' };
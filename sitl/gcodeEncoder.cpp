@@ -0,0 +1,93 @@
+// Host side encoder for the binary command protocol (see src/binaryProtocol.h).
+// Converts a text G-code program into a binary one that can be streamed to the firmware, or fed to cncSITL.
+// Usage: gcodeEncoder input.gcode output.bin
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "../src/binaryProtocol.h"
+
+namespace
+{
+	// Parse one line of text G-code. Returns false if the line has no operation.
+	bool parseLine(std::string line, GCodeOperation& op, int lineNumber)
+	{
+		line = line.substr(0, line.find_first_of(";\r"));
+		op = {};
+		size_t pos = line.find_first_not_of(' ');
+		if (pos == std::string::npos || line[pos] == '%')
+			return false;
+
+		const char address = line[pos];
+		if (address != 'G' && address != 'M')
+		{
+			std::cerr << "line " << lineNumber << ": skipping unsupported command " << line << "\n";
+			return false;
+		}
+		char* end;
+		op.address = uint8_t(address);
+		op.opCode = uint8_t(std::strtol(line.c_str() + pos + 1, &end, 10));
+		pos = end - line.c_str();
+
+		for (;;)
+		{
+			pos = line.find_first_not_of(' ', pos);
+			if (pos == std::string::npos)
+				break;
+			const std::string axes = "XYZFIJKR";
+			const size_t argPos = axes.find(line[pos]);
+			if (argPos == std::string::npos)
+			{
+				std::cerr << "line " << lineNumber << ": unknown argument in " << line << "\n";
+				return false;
+			}
+			const double value = std::strtod(line.c_str() + pos + 1, &end);
+			op.argument[argPos] = int32_t(std::lround(value * GCodeOperation::kArgScale));
+			pos = end - line.c_str();
+		}
+		return true;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		std::cerr << "Usage: gcodeEncoder input.gcode output.bin\n";
+		return -1;
+	}
+	std::ifstream input(argv[1]);
+	std::ofstream output(argv[2], std::ios::binary);
+	if (!input || !output)
+	{
+		std::cerr << "Unable to open files\n";
+		return -1;
+	}
+
+	output << "%B\n";
+	uint8_t frame[binaryProtocol::kMaxFrameSize];
+	uint8_t sequence = 0;
+	size_t textBytes = 0;
+	size_t binaryBytes = 0;
+	std::string line;
+	for (int lineNumber = 1; std::getline(input, line); ++lineNumber)
+	{
+		textBytes += line.size() + 1;
+		GCodeOperation op;
+		if (!parseLine(line, op, lineNumber))
+			continue;
+		const size_t size = binaryProtocol::encode(op, sequence++, frame);
+		output.write(reinterpret_cast<const char*>(frame), size);
+		binaryBytes += size;
+	}
+
+	// Leave binary mode
+	GCodeOperation end = {};
+	const size_t size = binaryProtocol::encode(end, sequence, frame);
+	output.write(reinterpret_cast<const char*>(frame), size);
+	binaryBytes += size;
+
+	std::cout << textBytes << " bytes of text encoded in " << binaryBytes << " bytes\n";
+	return 0;
+}
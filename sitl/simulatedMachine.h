@@ -0,0 +1,40 @@
+// Simulated machine axes, set up from the firmware axis descriptors (see axes.h)
+#pragma once
+#include "avrEmulation.h"
+#include "axes.h"
+#include "vcdRecorder.h"
+
+namespace sitl
+{
+	constexpr char portName(Port port)
+	{
+		return "ABCDEFGHJKL"[size_t(port)];
+	}
+
+	// Add Axis to the simulated machine, with its carriage position steps away from the endstop.
+	// Returns the index of the axis in simulatedAxes.
+	template<class Axis>
+	size_t simulateAxis(int32_t position)
+	{
+		using StepPin = typename Axis::Driver::StepPin;
+		using DirPin = typename Axis::Driver::DirPin;
+		using EndstopPin = typename Axis::Endstop::Pin;
+		simulatedAxes.push_back({
+			portName(StepPin::kPort), StepPin::kMask,
+			portName(DirPin::kPort), DirPin::kMask,
+			portName(EndstopPin::kPort), EndstopPin::kMask,
+			position });
+		return simulatedAxes.size() - 1;
+	}
+
+	// Dump the step, dir and enable pins of the driver of Axis into the VCD, as <name>.step, <name>.dir
+	// and <name>.enable
+	template<class Axis>
+	void dumpAxisPins(const std::string& name)
+	{
+		using Driver = typename Axis::Driver;
+		vcd::addSignal(name + ".step", portName(Driver::StepPin::kPort), Driver::StepPin::kMask);
+		vcd::addSignal(name + ".dir", portName(Driver::DirPin::kPort), Driver::DirPin::kMask);
+		vcd::addSignal(name + ".enable", portName(Driver::EnablePin::kPort), Driver::EnablePin::kMask);
+	}
+}
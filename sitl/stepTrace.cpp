@@ -0,0 +1,124 @@
+#include "stepTrace.h"
+#include "avrEmulation.h"
+
+namespace sitl::stepTrace
+{
+	namespace
+	{
+		// Records are buffered, and written in large chunks
+		struct Writer
+		{
+			~Writer() { flush(); }
+
+			void flush()
+			{
+				file.write(reinterpret_cast<const char*>(buffer.data()), std::streamsize(buffer.size()));
+				buffer.clear();
+				file.flush();
+			}
+
+			std::ofstream file;
+			std::vector<uint8_t> buffer;
+			uint64_t lastCycle = 0;
+			bool active = false;
+		};
+
+		Writer writer;
+		constexpr size_t kFlushSize = 1 << 16;
+
+		// Append a record, with the cpu cycles since the previous one
+		void write(uint64_t cycle, uint8_t axisByte)
+		{
+			if (!writer.active)
+				return;
+
+			writer.buffer.push_back(axisByte);
+			uint64_t delta = cycle - writer.lastCycle;
+			writer.lastCycle = cycle;
+			do
+			{
+				const uint8_t bits = delta & 0x7f;
+				delta >>= 7;
+				writer.buffer.push_back(uint8_t(bits | (delta ? 0x80 : 0)));
+			} while (delta);
+
+			if (writer.buffer.size() >= kFlushSize)
+				writer.flush();
+		}
+	}
+
+	bool start(const char* path, uint8_t numAxes)
+	{
+		writer.file.open(path, std::ios::binary);
+		if (!writer.file)
+			return false;
+
+		const uint32_t frequency = F_CPU;
+		writer.buffer.assign(kMagic, kMagic + 4);
+		writer.buffer.push_back(kVersion);
+		writer.buffer.push_back(numAxes);
+		for (int i = 0; i < 4; ++i)
+			writer.buffer.push_back(uint8_t(frequency >> (8 * i)));
+		writer.lastCycle = cpuCycles();
+		writer.active = true;
+		return true;
+	}
+
+	bool recording()
+	{
+		return writer.active;
+	}
+
+	void record(uint64_t cycle, uint8_t axis, bool forward)
+	{
+		write(cycle, uint8_t(axis | (forward ? kForward : 0)));
+	}
+
+	void recordEndstop(uint64_t cycle, uint8_t axis)
+	{
+		write(cycle, uint8_t(axis | kEndstop));
+	}
+
+	bool Reader::open(const char* path)
+	{
+		m_file.open(path, std::ios::binary);
+		uint8_t header[10];
+		if (!m_file.read(reinterpret_cast<char*>(header), sizeof(header)))
+			return false;
+		for (int i = 0; i < 4; ++i)
+		{
+			if (header[i] != uint8_t(kMagic[i]))
+				return false;
+		}
+		if (header[4] != kVersion)
+			return false;
+
+		m_numAxes = header[5];
+		m_frequency = 0;
+		for (int i = 0; i < 4; ++i)
+			m_frequency |= uint32_t(header[6 + i]) << (8 * i);
+		m_cycle = 0;
+		return true;
+	}
+
+	bool Reader::next(Step& step)
+	{
+		const int axis = m_file.get();
+		if (axis == std::char_traits<char>::eof())
+			return false;
+
+		uint64_t delta = 0;
+		for (int shift = 0;; shift += 7)
+		{
+			const int c = m_file.get();
+			if (c == std::char_traits<char>::eof())
+				return false;
+			delta |= uint64_t(c & 0x7f) << shift;
+			if (!(c & 0x80))
+				break;
+		}
+		m_cycle += delta;
+		step = { m_cycle, uint8_t(axis & ~(kForward | kEndstop)), (axis & kForward) != 0, (axis & kEndstop) != 0 };
+		return true;
+	}
+}
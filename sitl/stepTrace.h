@@ -0,0 +1,57 @@
+// Step event trace of the simulated machine. Built into cncSITL with STEP_TRACE, and read by stepTraceAnalysis.
+// Every step of a simulated axis (see avrEmulation.h) is recorded with the cpu cycle it happened at.
+//
+// File format, little endian:
+//   Header: "STRC", uint8 version, uint8 number of axes, uint32 cpu frequency in Hz
+//   One record per step: uint8 axis index, with kForward set for forward steps, followed by the cpu cycles
+//   since the previous record as an unsigned LEB128 varint. Steps of different axes in the same event
+//   are 0 cycles apart, so most records take 2 or 3 bytes.
+//   Endstops triggering are recorded the same way, with kEndstop set in the axis byte.
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+namespace sitl::stepTrace
+{
+	constexpr char kMagic[4] = { 'S', 'T', 'R', 'C' };
+	constexpr uint8_t kVersion = 2;
+	constexpr uint8_t kForward = 0x80;
+	constexpr uint8_t kEndstop = 0x40;
+
+	struct Step
+	{
+		uint64_t cycle;
+		uint8_t axis;
+		bool forward;
+		bool endstop; // Not a step, but the endstop of the axis triggering
+	};
+
+	// Record the steps of the simulated axes into the file at path from now on. Returns false if the
+	// file can't be written. The trace is flushed at exit.
+	bool start(const char* path, uint8_t numAxes);
+	bool recording();
+	// Called by the emulation on every step of a simulated axis
+	void record(uint64_t cycle, uint8_t axis, bool forward);
+	// Called by the emulation when the endstop of a simulated axis triggers
+	void recordEndstop(uint64_t cycle, uint8_t axis);
+
+	// Reads a trace file back
+	class Reader
+	{
+	public:
+		// Returns false if the file is missing or isn't a trace
+		bool open(const char* path);
+		// Returns false at the end of the trace
+		bool next(Step& step);
+
+		uint8_t numAxes() const { return m_numAxes; }
+		uint32_t frequency() const { return m_frequency; }
+
+	private:
+		std::ifstream m_file;
+		uint8_t m_numAxes = 0;
+		uint32_t m_frequency = 0;
+		uint64_t m_cycle = 0;
+	};
+}
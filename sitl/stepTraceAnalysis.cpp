@@ -0,0 +1,313 @@
+// Kinematic analysis of the step traces recorded by cncSITL (see stepTrace.h).
+// Rebuilds the position, velocity, acceleration and jerk curves of every axis from its steps, and reports
+// where they exceed the limits in HardwareConfig.h, so motion settings can be validated before running
+// them on the machine.
+// The firmware changes velocity instantly in a few places by design, and these are not violations:
+// - Moves start from rest and stop at kMinStepRate. The first step period of a move is that long, and the
+//   rate catches up with the acceleration ramp on the next one.
+// - Axes change speed at the junction of two moves, as much as the junction deviation model allows.
+// - Endstops halt the motion, whether homing or hitting a hard limit.
+// Usage: stepTraceAnalysis trace.bin [--window=ms] [--tolerance=percent]
+// Exits with 1 if any axis broke a limit.
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include "HardwareConfig.h"
+#include "motionTables.h"
+#include "stepTrace.h"
+
+namespace
+{
+	struct AxisLimits
+	{
+		char name;
+		float steps_mm;
+		float speed; // mm/s
+		float acceleration; // mm/s^2
+		float jerk; // mm/s^3
+	};
+
+	// Axes in the order cncSITL simulates them
+	const AxisLimits kAxes[] = {
+		{ 'X', float(kSteps_mmX.count()), float(kMaxSpeedX.count()), float(kMaxAccelX.count()), float(kMaxJerkX.count()) },
+		{ 'Y', float(kSteps_mmY.count()), float(kMaxSpeedY.count()), float(kMaxAccelY.count()), float(kMaxJerkY.count()) },
+		{ 'Z', float(kSteps_mmZ.count()), float(kMaxSpeedZ.count()), float(kMaxAccelZ.count()), float(kMaxJerkZ.count()) },
+	};
+	constexpr size_t kNumAxes = sizeof(kAxes) / sizeof(kAxes[0]);
+
+	// Trapezoidal profiles change acceleration instantly. Jerk is only limited with S-curves.
+	constexpr bool kCheckJerk = kVelocityProfile == VelocityProfile::sCurve;
+
+	constexpr double kSamplePeriod = 1e-3; // s
+
+	// Fastest the carriage of an axis can move along the direction u
+	float pathMaxSpeed(const float* u, size_t numAxes)
+	{
+		float speed = 1e9f;
+		for (size_t i = 0; i < numAxes; ++i)
+			if (std::fabs(u[i]) > 1e-3f)
+				speed = std::fmin(speed, kAxes[i].speed / std::fabs(u[i]));
+		return speed;
+	}
+
+	float pathMaxAcceleration(const float* u, size_t numAxes)
+	{
+		float acceleration = 1e9f;
+		for (size_t i = 0; i < numAxes; ++i)
+			if (std::fabs(u[i]) > 1e-3f)
+				acceleration = std::fmin(acceleration, kAxes[i].acceleration / std::fabs(u[i]));
+		return acceleration;
+	}
+
+	// Largest instant velocity change of each axis that the firmware allows between the motion before and
+	// after: Starting or stopping at kMinStepRate, plus what the ramp gains during that first step period,
+	// and changing direction at the junction of two moves at up to the speed the junction deviation model
+	// allows (see Planner::junctionSpeed2).
+	std::vector<float> allowedJumps(const float* before, const float* after, size_t numAxes)
+	{
+		std::vector<float> jumps(numAxes);
+		for (size_t i = 0; i < numAxes; ++i)
+			jumps[i] = float(kMinStepRate) / kAxes[i].steps_mm + kAxes[i].acceleration / float(kMinStepRate);
+
+		float speedBefore = 0, speedAfter = 0;
+		for (size_t i = 0; i < numAxes; ++i)
+		{
+			speedBefore += before[i] * before[i];
+			speedAfter += after[i] * after[i];
+		}
+		speedBefore = std::sqrt(speedBefore);
+		speedAfter = std::sqrt(speedAfter);
+		if (speedBefore < 1e-3f || speedAfter < 1e-3f)
+			return jumps; // Starts from rest or comes to a stop
+
+		float u1[kNumAxes], u2[kNumAxes];
+		float cosTheta = 0;
+		for (size_t i = 0; i < numAxes; ++i)
+		{
+			u1[i] = before[i] / speedBefore;
+			u2[i] = after[i] / speedAfter;
+			cosTheta -= u1[i] * u2[i];
+		}
+		if (cosTheta > 0.999f)
+			return jumps; // Full reversal. The planner stops at the junction.
+
+		float junctionSpeed = std::fmin(pathMaxSpeed(u1, numAxes), pathMaxSpeed(u2, numAxes));
+		if (cosTheta >= -0.999f)
+		{
+			const float sinHalfTheta = std::sqrt(0.5f * (1 - cosTheta));
+			const float acceleration = std::fmin(pathMaxAcceleration(u1, numAxes), pathMaxAcceleration(u2, numAxes));
+			const float deviation_mm = kJunctionDeviation.count() / 1000.f;
+			junctionSpeed = std::fmin(junctionSpeed, std::sqrt(acceleration * deviation_mm * sinHalfTheta / (1 - sinHalfTheta)));
+		}
+		for (size_t i = 0; i < numAxes; ++i)
+			jumps[i] += junctionSpeed * std::fabs(u2[i] - u1[i]);
+		return jumps;
+	}
+
+	// Position of an axis at every sample, in mm. The carriage moves steadily between consecutive steps in
+	// the same direction, unless they are more than maxGap cycles apart, and stands still otherwise.
+	std::vector<float> samplePositions(const std::vector<sitl::stepTrace::Step>& steps, size_t numSamples, double cyclesPerSample, double maxGap, float steps_mm)
+	{
+		std::vector<float> positions;
+		positions.reserve(numSamples);
+		int32_t position = 0;
+		size_t next = 0;
+		for (size_t sample = 0; sample < numSamples; ++sample)
+		{
+			const double cycle = sample * cyclesPerSample;
+			for (; next < steps.size() && steps[next].cycle <= cycle; ++next)
+				position += steps[next].forward ? 1 : -1;
+
+			double interpolated = position;
+			if (next > 0 && next < steps.size() && steps[next].forward == steps[next - 1].forward)
+			{
+				const double gap = double(steps[next].cycle - steps[next - 1].cycle);
+				if (gap <= maxGap)
+					interpolated += (steps[next].forward ? 1 : -1) * (cycle - steps[next - 1].cycle) / gap;
+			}
+			positions.push_back(float(interpolated / steps_mm));
+		}
+		return positions;
+	}
+
+	// Derivative of f by central differences, window samples apart
+	std::vector<float> derivative(const std::vector<float>& f, size_t window)
+	{
+		std::vector<float> d(f.size(), 0.f);
+		const size_t half = window / 2;
+		const float dt = float(2 * half * kSamplePeriod);
+		for (size_t i = half; i + half < f.size(); ++i)
+			d[i] = (f[i + half] - f[i - half]) / dt;
+		return d;
+	}
+
+	// A stretch of a curve over its limit
+	struct Stretch
+	{
+		size_t start, end; // Samples
+		float worst;
+	};
+
+	// Print the peak of the curve, and return every stretch of it over the limit
+	std::vector<Stretch> findStretches(const char* quantity, const char* unit, const std::vector<float>& curve, float limit, float tolerance, bool enforced)
+	{
+		float peak = 0;
+		for (float value : curve)
+			peak = std::fmax(peak, std::fabs(value));
+		std::cout << "  " << quantity << ": peak " << peak << " " << unit << ", limit " << limit;
+		std::cout << (enforced ? "\n" : " (not enforced by the velocity profile)\n");
+		std::vector<Stretch> stretches;
+		if (!enforced)
+			return stretches;
+
+		const float threshold = limit * (1 + tolerance);
+		for (size_t i = 0; i < curve.size();)
+		{
+			if (std::fabs(curve[i]) <= threshold)
+			{
+				++i;
+				continue;
+			}
+			Stretch stretch = { i, i, 0.f };
+			for (; i < curve.size() && std::fabs(curve[i]) > threshold; ++i)
+				stretch.worst = std::fmax(stretch.worst, std::fabs(curve[i]));
+			stretch.end = i;
+			stretches.push_back(stretch);
+		}
+		return stretches;
+	}
+
+	// Print a stretch over the limit. Returns 1 to count it as a violation.
+	int report(char axis, const char* quantity, const char* unit, const Stretch& stretch)
+	{
+		std::cout << "  ! " << axis << " " << quantity << " " << stretch.worst << " " << unit << " from " << stretch.start * kSamplePeriod
+			<< "s to " << stretch.end * kSamplePeriod << "s\n";
+		return 1;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		std::cerr << "Usage: stepTraceAnalysis trace.bin [--window=ms] [--tolerance=percent]\n";
+		return 2;
+	}
+
+	// Differences over a window of a few ms average out the jitter of single steps
+	size_t window = 10;
+	float tolerance = 0.2f;
+	for (int i = 2; i < argc; ++i)
+	{
+		if (strncmp(argv[i], "--window=", 9) == 0)
+			window = std::max<size_t>(2, size_t(atoi(argv[i] + 9)));
+		else if (strncmp(argv[i], "--tolerance=", 12) == 0)
+			tolerance = float(atof(argv[i] + 12)) / 100;
+	}
+
+	sitl::stepTrace::Reader reader;
+	if (!reader.open(argv[1]))
+	{
+		std::cerr << "Can't read a step trace from " << argv[1] << "\n";
+		return 2;
+	}
+	if (reader.numAxes() > kNumAxes)
+	{
+		std::cerr << "The trace has " << int(reader.numAxes()) << " axes, and only " << kNumAxes << " have known limits\n";
+		return 2;
+	}
+
+	std::vector<std::vector<sitl::stepTrace::Step>> steps(reader.numAxes());
+	std::vector<uint64_t> endstopHits; // Cycles
+	sitl::stepTrace::Step step;
+	uint64_t lastCycle = 0;
+	while (reader.next(step))
+	{
+		if (step.endstop)
+			endstopHits.push_back(step.cycle);
+		else if (step.axis < reader.numAxes())
+			steps[step.axis].push_back(step);
+		lastCycle = step.cycle;
+	}
+
+	// Hold the final positions long enough for the derivatives to settle
+	const double cyclesPerSample = reader.frequency() * kSamplePeriod;
+	const size_t numSamples = size_t(lastCycle / cyclesPerSample) + 4 * window;
+	const double maxGap = window * cyclesPerSample / 2;
+
+	const size_t numAxes = steps.size();
+	std::vector<std::vector<float>> velocity(numAxes), acceleration(numAxes), jerk(numAxes);
+	for (size_t axis = 0; axis < numAxes; ++axis)
+	{
+		const std::vector<float> position = samplePositions(steps[axis], numSamples, cyclesPerSample, maxGap, kAxes[axis].steps_mm);
+		velocity[axis] = derivative(position, window);
+		acceleration[axis] = derivative(velocity[axis], window);
+		jerk[axis] = derivative(acceleration[axis], window);
+	}
+
+	// An instant velocity change spreads over the differentiation windows. In acceleration it becomes a
+	// peak of jump / window, in jerk one of jump / window^2, that reach 2 windows each side of the change.
+	// Longer stretches over the limit are never explained by one.
+	const float windowTime = float(window / 2 * 2 * kSamplePeriod);
+	const size_t reach = 2 * window;
+	auto instant = [&](const Stretch& stretch) { return stretch.end - stretch.start <= 2 * reach; };
+
+	// Stretches next to an endstop hit are the halt itself
+	auto nearEndstopHit = [&](const Stretch& stretch)
+	{
+		for (uint64_t cycle : endstopHits)
+		{
+			const size_t sample = size_t(cycle / cyclesPerSample);
+			if (stretch.start <= sample + reach && sample <= stretch.end + reach)
+				return true;
+		}
+		return false;
+	};
+
+	// Other stretches are fine if an instant velocity change the firmware allows explains them, with the
+	// motion before and after sampled out of reach of the change
+	auto allowedExcess = [&](const Stretch& stretch, size_t axis, int order)
+	{
+		const size_t before = stretch.start > reach ? stretch.start - reach : 0;
+		const size_t after = stretch.end + reach < numSamples ? stretch.end + reach : numSamples - 1;
+		std::vector<float> vBefore(numAxes), vAfter(numAxes);
+		for (size_t i = 0; i < numAxes; ++i)
+		{
+			vBefore[i] = velocity[i][before];
+			vAfter[i] = velocity[i][after];
+		}
+		const float jump = allowedJumps(vBefore.data(), vAfter.data(), numAxes)[axis];
+		return order == 1 ? jump / windowTime : jump / (windowTime * windowTime);
+	};
+
+	int violations = 0;
+	int expected = 0;
+	for (size_t axis = 0; axis < numAxes; ++axis)
+	{
+		const AxisLimits& limits = kAxes[axis];
+		std::cout << limits.name << ": " << steps[axis].size() << " steps\n";
+		for (const Stretch& stretch : findStretches("speed", "mm/s", velocity[axis], limits.speed, tolerance, true))
+			violations += report(limits.name, "speed", "mm/s", stretch);
+
+		auto checkDerivative = [&](const char* quantity, const char* unit, const std::vector<float>& curve, float limit, int order, bool enforced)
+		{
+			for (const Stretch& stretch : findStretches(quantity, unit, curve, limit, tolerance, enforced))
+			{
+				if (instant(stretch) && (nearEndstopHit(stretch) || stretch.worst <= (limit + allowedExcess(stretch, axis, order)) * (1 + tolerance)))
+					++expected;
+				else
+					violations += report(limits.name, quantity, unit, stretch);
+			}
+		};
+		checkDerivative("acceleration", "mm/s^2", acceleration[axis], limits.acceleration, 1, true);
+		checkDerivative("jerk", "mm/s^3", jerk[axis], limits.jerk, 2, kCheckJerk);
+	}
+
+	std::cout << expected << " expected velocity changes (move starts and stops, junctions, endstop hits)\n";
+
+	std::cout << violations << " limit violations\n";
+	return violations ? 1 : 0;
+}
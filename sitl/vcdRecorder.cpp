@@ -0,0 +1,101 @@
+#include "vcdRecorder.h"
+#include <fstream>
+#include <vector>
+#include "avrEmulation.h"
+
+namespace sitl::vcd
+{
+	namespace
+	{
+		// Picoseconds per cpu cycle. The timescale of the dump is 1ps, so timestamps stay integer
+		constexpr uint64_t kCycle_ps = 1'000'000'000'000 / F_CPU;
+
+		struct Signal
+		{
+			std::string name;
+			std::string id; // Short identifier of the signal in value changes
+			char port;
+			uint8_t mask;
+			bool value;
+		};
+
+		struct Recorder
+		{
+			std::ofstream file; // Flushed when closed at exit
+			std::vector<Signal> signals;
+			bool active = false;
+		};
+
+		Recorder recorder;
+
+		// Identifiers are made of the printable characters '!' to '~'
+		std::string identifier(size_t index)
+		{
+			std::string id;
+			do
+			{
+				id += char('!' + index % 94);
+				index /= 94;
+			} while (index);
+			return id;
+		}
+
+		void portWritten(const PortWrite& write)
+		{
+			bool stamped = false;
+			for (Signal& signal : recorder.signals)
+			{
+				const bool value = write.value & signal.mask;
+				if (signal.port != write.port || value == signal.value)
+					continue;
+				signal.value = value;
+				if (!stamped)
+				{
+					recorder.file << '#' << write.cycle * kCycle_ps << '\n';
+					stamped = true;
+				}
+				recorder.file << (value ? '1' : '0') << signal.id << '\n';
+			}
+		}
+	}
+
+	void addSignal(const std::string& name, char port, uint8_t mask)
+	{
+		recorder.signals.push_back({ name, identifier(recorder.signals.size()), port, mask, false });
+	}
+
+	bool start(const char* path)
+	{
+		recorder.file.open(path);
+		if (!recorder.file)
+			return false;
+
+		std::ofstream& file = recorder.file;
+		file << "$version cncSITL $end\n";
+		file << "$timescale 1ps $end\n";
+		file << "$scope module atmega2560 $end\n";
+		for (const Signal& signal : recorder.signals)
+			file << "$var wire 1 " << signal.id << ' ' << signal.name << " $end\n";
+		file << "$upscope $end\n";
+		file << "$enddefinitions $end\n";
+
+		// Initial state of the pins, at the current cycle
+		file << '#' << cpuCycles() * kCycle_ps << "\n$dumpvars\n";
+		for (Signal& signal : recorder.signals)
+		{
+			const uint8_t port = portValue(signal.port);
+			signal.value = port & signal.mask;
+			file << (signal.value ? '1' : '0') << signal.id << '\n';
+		}
+		file << "$end\n";
+
+		portWriteObserver = portWritten;
+		recorder.active = true;
+		return true;
+	}
+
+	bool recording()
+	{
+		return recorder.active;
+	}
+}
@@ -0,0 +1,18 @@
+// Virtual logic analyzer. Dumps the activity of output pins of the simulated atmega into a Value Change
+// Dump file, with every transition timestamped to the cpu cycle. VCD files open in GTKWave and most
+// other waveform viewers, where pulse widths, dir to step setup times and skew between axes can be measured.
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace sitl::vcd
+{
+	// Dump the pin at mask of the output port as a signal with the given name.
+	// Signals must be added before start.
+	void addSignal(const std::string& name, char port, uint8_t mask);
+
+	// Dump the signals into the file at path from now on. Returns false if the file can't be written.
+	// Takes over sitl::portWriteObserver. The dump is flushed at exit.
+	bool start(const char* path);
+	bool recording();
+}
@@ -21,7 +21,11 @@ struct GCodeOperation
 {
 	// Arguments first for more compact alignment
 	static constexpr int32_t kEmptyArg = int32_t(1ul << 31);
-	int32_t argument[4] = { kEmptyArg, kEmptyArg, kEmptyArg, kEmptyArg }; // X,Y,Z,F
+	// Arguments are fixed point numbers with three decimals. Coordinates are in micrometers.
+	static constexpr int32_t kArgScale = 1000;
+	// Arc centers (I,J,K) are offsets from the start of the move. R is the arc radius.
+	static constexpr uint8_t kNumArgs = 8;
+	int32_t argument[kNumArgs] = { kEmptyArg, kEmptyArg, kEmptyArg, kEmptyArg, kEmptyArg, kEmptyArg, kEmptyArg, kEmptyArg }; // X,Y,Z,F,I,J,K,R
 	// Instruction
 	uint8_t address;
 	uint8_t opCode; // [0,99] -> G, [100,199] -> M
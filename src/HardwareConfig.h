@@ -43,14 +43,51 @@ constexpr int32_t XstepsPerMM = 200 * 16 / 2;
 constexpr int32_t YstepsPerMM = int32_t(microStepsPerRevolution / (13 * 2 * 3.14159f));
 constexpr int32_t ZstepsPerMM = 200 * 16 / 2;
 */
-constexpr auto kMaxSpeedX = 5_mm / 1s; // mm/s
+constexpr auto kMaxSpeedX = 10_mm / 1s; // mm/s
 constexpr auto kMaxSpeedY = 50_mm / 1s; // mm/s
-constexpr auto kMaxSpeedZ = 5_mm / 1s; // mm/s
+constexpr auto kMaxSpeedZ = 10_mm / 1s; // mm/s
 
-constexpr auto kMaxSteps_secX = kMaxSpeedX * kSteps_mmX;
-constexpr auto kMaxSteps_secY = kMaxSpeedY * kSteps_mmY;
-constexpr auto kMaxSteps_secZ = kMaxSpeedZ * kSteps_mmZ;
+constexpr auto kMaxAccelX = mm_second2(100); // mm/s^2
+constexpr auto kMaxAccelY = mm_second2(500); // mm/s^2
+constexpr auto kMaxAccelZ = mm_second2(50); // mm/s^2
 
-constexpr auto kMinStepPeriodX = us_step(int32_t(1'000'000.f / kMaxSteps_secX.count() + 0.5f)); // us/step
-constexpr auto kMinStepPeriodY = us_step(int32_t(1'000'000.f / kMaxSteps_secY.count() + 0.5f)); // us/step
-constexpr auto kMinStepPeriodZ = us_step(int32_t(1'000'000.f / kMaxSteps_secZ.count() + 0.5f)); // us/step
+// Velocity profile of every move.
+// Trapezoidal profiles change acceleration instantly at the start and end of every ramp.
+// S-curve profiles also limit jerk, so acceleration builds up smoothly and doesn't excite resonances.
+enum class VelocityProfile
+{
+	trapezoidal,
+	sCurve
+};
+constexpr auto kVelocityProfile = VelocityProfile::trapezoidal;
+
+constexpr auto kMaxJerkX = mm_second3(2000); // mm/s^3
+constexpr auto kMaxJerkY = mm_second3(10000); // mm/s^3
+constexpr auto kMaxJerkZ = mm_second3(1000); // mm/s^3
+
+// Raise step pins in one step timer event and lower them from a later compare match, instead of
+// busy waiting for the pulse width inside the step interrupt.
+constexpr bool kSplitStepPulses = true;
+
+// Homing cycle (G30). Each axis seeks its endstop at kHomingSeekFeed, backs off kHomingPullOff and
+// approaches it again at kHomingLocateFeed, so the switch latches at a repeatable point no matter how
+// fast the seek was. The origin of the axis is left kHomingPullOff away from the switch.
+constexpr auto kHomingSeekFeed = um_second(10'000); // Clamped to the max speed of the axis
+constexpr auto kHomingLocateFeed = um_second(1'000);
+constexpr auto kHomingPullOff = 1_mm;
+constexpr auto kHomingMaxTravel = 500_mm; // Give up if the endstop doesn't trigger within this distance
+
+// Endstop inputs have pull-ups and read high when triggered, as with normally closed switches to
+// ground. Inverted endstops read low when triggered instead.
+constexpr bool kEndstopInverted = false;
+
+// Moves leave the look-ahead planner, and their speed profiles become final, once the step engine has
+// less than this much work queued. Longer stalls of the main loop are survived with a longer time, while
+// a shorter one leaves more moves in the planner to look ahead across.
+constexpr auto kSegmentLookAhead = 30ms;
+
+// Max distance from the path to the corner when cutting through the junction of two moves
+constexpr auto kJunctionDeviation = 20_um;
+
+// Max distance between arcs (G2, G3) and the chords they are split into
+constexpr auto kArcTolerance = 10_um;
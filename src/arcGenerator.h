@@ -0,0 +1,127 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+// Plane of arc moves, selected with G17, G18 and G19
+enum class ArcPlane : uint8_t
+{
+	xy, // G17
+	zx, // G18
+	yz, // G19
+};
+
+// Axes of an arc plane, in the order that makes the normal axis point towards the viewer
+struct ArcAxes
+{
+	uint8_t first;
+	uint8_t second;
+	uint8_t normal;
+};
+
+constexpr ArcAxes arcAxes(ArcPlane plane)
+{
+	return plane == ArcPlane::xy ? ArcAxes{ 0, 1, 2 } : plane == ArcPlane::zx ? ArcAxes{ 2, 0, 1 } : ArcAxes{ 1, 2, 0 };
+}
+
+// Splits circular arcs into chords that never stray further than a given tolerance from the arc.
+// Helical arcs move the normal axis linearly along the way.
+// Chords are generated one at a time, as the planner makes room for them, so arcs of any length
+// take no extra memory. Float math, main loop only.
+class ArcGenerator
+{
+public:
+	// Positions and lengths in mm. center holds the coordinates of the center on the plane axes.
+	// Clockwise as seen from the positive end of the normal axis. Arcs that end where they start are full circles.
+	void start(const float startPos[3], const float endPos[3], const float center[2], ArcPlane plane, bool clockwise, float tolerance);
+
+	// There are chords left
+	bool active() const { return m_chordsLeft > 0; }
+	// End point of the next chord. The last one ends exactly at the end of the arc.
+	void next(float pos[3]);
+
+private:
+	static constexpr float kTwoPi = 2 * float(M_PI);
+	// Angles smaller than this between start and end are taken as full circles
+	static constexpr float kAngleEpsilon = 5e-7f;
+
+	ArcAxes m_axes = {};
+	float m_center[2] = {};
+	float m_radius = 0;
+	float m_startAngle = 0;
+	float m_angleStep = 0;
+	float m_startNormal = 0;
+	float m_normalStep = 0;
+	float m_end[3] = {};
+	uint16_t m_chord = 0;
+	uint16_t m_chordsLeft = 0;
+};
+
+inline void ArcGenerator::start(const float startPos[3], const float endPos[3], const float center[2], ArcPlane plane, bool clockwise, float tolerance)
+{
+	m_axes = arcAxes(plane);
+	m_center[0] = center[0];
+	m_center[1] = center[1];
+	for (int i = 0; i < 3; ++i)
+		m_end[i] = endPos[i];
+
+	const float startX = startPos[m_axes.first] - center[0];
+	const float startY = startPos[m_axes.second] - center[1];
+	const float endX = endPos[m_axes.first] - center[0];
+	const float endY = endPos[m_axes.second] - center[1];
+	m_radius = sqrtf(startX * startX + startY * startY);
+	m_startAngle = atan2f(startY, startX);
+
+	// Angle travelled, negative when clockwise
+	float angle = atan2f(startX * endY - startY * endX, startX * endX + startY * endY);
+	if (clockwise)
+	{
+		if (angle >= -kAngleEpsilon)
+			angle -= kTwoPi;
+	}
+	else if (angle <= kAngleEpsilon)
+		angle += kTwoPi;
+
+	// A chord spanning an angle a is r * (1 - cos(a/2)) away from the arc at its center
+	const float maxChordAngle = 2 * acosf(fmaxf(1 - tolerance / m_radius, 0.f));
+	const float chords = ceilf(fabsf(angle) / maxChordAngle);
+	m_chordsLeft = uint16_t(fminf(fmaxf(chords, 1.f), 65535.f));
+	m_chord = 0;
+	m_angleStep = angle / m_chordsLeft;
+	m_startNormal = startPos[m_axes.normal];
+	m_normalStep = (endPos[m_axes.normal] - m_startNormal) / m_chordsLeft;
+}
+
+inline void ArcGenerator::next(float pos[3])
+{
+	++m_chord;
+	if (--m_chordsLeft == 0)
+	{
+		for (int i = 0; i < 3; ++i)
+			pos[i] = m_end[i];
+		return;
+	}
+
+	// Every point is computed from the start of the arc, so rounding errors don't accumulate
+	const float angle = m_startAngle + m_chord * m_angleStep;
+	pos[m_axes.first] = m_center[0] + m_radius * cosf(angle);
+	pos[m_axes.second] = m_center[1] + m_radius * sinf(angle);
+	pos[m_axes.normal] = m_startNormal + m_chord * m_normalStep;
+}
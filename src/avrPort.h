@@ -0,0 +1,291 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <Arduino.h>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+// Direct access to the atmega2560 IO ports.
+// Pins that share a port can be written together with a single read-modify-write of the port register.
+enum class Port : uint8_t
+{
+	A, B, C, D, E, F, G, H, J, K, L,
+	Count
+};
+
+template<Port port>
+inline auto& portRegister()
+{
+	if constexpr (port == Port::A) return PORTA;
+	else if constexpr (port == Port::B) return PORTB;
+	else if constexpr (port == Port::C) return PORTC;
+	else if constexpr (port == Port::D) return PORTD;
+	else if constexpr (port == Port::E) return PORTE;
+	else if constexpr (port == Port::F) return PORTF;
+	else if constexpr (port == Port::G) return PORTG;
+	else if constexpr (port == Port::H) return PORTH;
+	else if constexpr (port == Port::J) return PORTJ;
+	else if constexpr (port == Port::K) return PORTK;
+	else return PORTL;
+}
+
+template<Port port>
+inline auto& directionRegister()
+{
+	if constexpr (port == Port::A) return DDRA;
+	else if constexpr (port == Port::B) return DDRB;
+	else if constexpr (port == Port::C) return DDRC;
+	else if constexpr (port == Port::D) return DDRD;
+	else if constexpr (port == Port::E) return DDRE;
+	else if constexpr (port == Port::F) return DDRF;
+	else if constexpr (port == Port::G) return DDRG;
+	else if constexpr (port == Port::H) return DDRH;
+	else if constexpr (port == Port::J) return DDRJ;
+	else if constexpr (port == Port::K) return DDRK;
+	else return DDRL;
+}
+
+template<Port port>
+inline auto& inputRegister()
+{
+	if constexpr (port == Port::A) return PINA;
+	else if constexpr (port == Port::B) return PINB;
+	else if constexpr (port == Port::C) return PINC;
+	else if constexpr (port == Port::D) return PIND;
+	else if constexpr (port == Port::E) return PINE;
+	else if constexpr (port == Port::F) return PINF;
+	else if constexpr (port == Port::G) return PING;
+	else if constexpr (port == Port::H) return PINH;
+	else if constexpr (port == Port::J) return PINJ;
+	else if constexpr (port == Port::K) return PINK;
+	else return PINL;
+}
+
+template<int group>
+inline auto& pinChangeMaskRegister()
+{
+	if constexpr (group == 0) return PCMSK0;
+	else if constexpr (group == 1) return PCMSK1;
+	else return PCMSK2;
+}
+
+// Sense control register of external interrupt INTn
+template<int n>
+inline auto& senseControlRegister()
+{
+	if constexpr (n < 4) return EICRA;
+	else return EICRB;
+}
+
+// Pin edges that raise interrupts, as coded in the external interrupt sense control bits
+enum class PinEdge : uint8_t
+{
+	change = 1,
+	falling = 2,
+	rising = 3
+};
+
+namespace detail
+{
+	// External interrupt (INTn) on the pin, or -1
+	constexpr int externalInterrupt(Port port, uint8_t bit)
+	{
+		if (port == Port::D && bit < 4) return bit;
+		if (port == Port::E && bit >= 4) return bit;
+		return -1;
+	}
+
+	// Pin change interrupt group (PCIEn) of the pin, or -1
+	constexpr int pinChangeGroup(Port port, uint8_t bit)
+	{
+		if (port == Port::B) return 0;
+		if ((port == Port::E && bit == 0) || (port == Port::J && bit < 7)) return 1;
+		if (port == Port::K) return 2;
+		return -1;
+	}
+
+	// Bit of the pin in the mask register of its pin change group
+	constexpr uint8_t pinChangeBit(Port port, uint8_t bit)
+	{
+		return port == Port::J ? bit + 1 : port == Port::E ? 0 : bit;
+	}
+}
+
+template<Port port_, uint8_t bit_>
+struct PortPin
+{
+	static constexpr Port kPort = port_;
+	static constexpr uint8_t kMask = 1 << bit_;
+	static constexpr int kExternalInterrupt = detail::externalInterrupt(port_, bit_);
+	static constexpr int kPinChangeGroup = detail::pinChangeGroup(port_, bit_);
+
+	static void setOutput() { directionRegister<port_>() |= kMask; }
+	static void setHigh() { portRegister<port_>() |= kMask; }
+	static void setLow() { portRegister<port_>() &= uint8_t(~kMask); }
+
+	// Inputs with pullUp read high unless driven low externally
+	static void setInput(bool pullUp)
+	{
+		directionRegister<port_>() &= uint8_t(~kMask);
+		if (pullUp)
+			setHigh();
+		else
+			setLow();
+	}
+	static bool read() { return inputRegister<port_>() & kMask; }
+
+	// Raise an interrupt when the pin changes. Pins with an external interrupt raise INTn_vect, on the
+	// given edge only. Any other pin raises the PCINTn_vect of its group on every change.
+	static void enableInterrupt(PinEdge edge)
+	{
+		if constexpr (kExternalInterrupt >= 0)
+		{
+			constexpr uint8_t shift = 2 * (kExternalInterrupt % 4);
+			auto& senseControl = senseControlRegister<kExternalInterrupt>();
+			senseControl = uint8_t((senseControl & ~(3 << shift)) | (uint8_t(edge) << shift));
+			EIFR = 1 << kExternalInterrupt; // Changing the sense can raise the flag
+			EIMSK |= 1 << kExternalInterrupt;
+		}
+		else
+		{
+			static_assert(kPinChangeGroup >= 0, "The pin can't raise interrupts");
+			pinChangeMaskRegister<kPinChangeGroup>() |= 1 << detail::pinChangeBit(port_, bit_);
+			PCICR |= 1 << kPinChangeGroup;
+		}
+	}
+};
+
+namespace detail
+{
+	struct MegaPinLocation
+	{
+		Port port;
+		uint8_t bit;
+	};
+
+	// Arduino Mega pin numbers to atmega2560 ports
+	constexpr MegaPinLocation kMegaPins[] = {
+		{ Port::E, 0 }, { Port::E, 1 }, { Port::E, 4 }, { Port::E, 5 }, { Port::G, 5 }, // 0-4
+		{ Port::E, 3 }, { Port::H, 3 }, { Port::H, 4 }, { Port::H, 5 }, { Port::H, 6 }, // 5-9
+		{ Port::B, 4 }, { Port::B, 5 }, { Port::B, 6 }, { Port::B, 7 }, { Port::J, 1 }, // 10-14
+		{ Port::J, 0 }, { Port::H, 1 }, { Port::H, 0 }, { Port::D, 3 }, { Port::D, 2 }, // 15-19
+		{ Port::D, 1 }, { Port::D, 0 }, { Port::A, 0 }, { Port::A, 1 }, { Port::A, 2 }, // 20-24
+		{ Port::A, 3 }, { Port::A, 4 }, { Port::A, 5 }, { Port::A, 6 }, { Port::A, 7 }, // 25-29
+		{ Port::C, 7 }, { Port::C, 6 }, { Port::C, 5 }, { Port::C, 4 }, { Port::C, 3 }, // 30-34
+		{ Port::C, 2 }, { Port::C, 1 }, { Port::C, 0 }, { Port::D, 7 }, { Port::G, 2 }, // 35-39
+		{ Port::G, 1 }, { Port::G, 0 }, { Port::L, 7 }, { Port::L, 6 }, { Port::L, 5 }, // 40-44
+		{ Port::L, 4 }, { Port::L, 3 }, { Port::L, 2 }, { Port::L, 1 }, { Port::L, 0 }, // 45-49
+		{ Port::B, 3 }, { Port::B, 2 }, { Port::B, 1 }, { Port::B, 0 }, // 50-53
+		{ Port::F, 0 }, { Port::F, 1 }, { Port::F, 2 }, { Port::F, 3 }, // 54-57 (A0-A3)
+		{ Port::F, 4 }, { Port::F, 5 }, { Port::F, 6 }, { Port::F, 7 }, // 58-61 (A4-A7)
+		{ Port::K, 0 }, { Port::K, 1 }, { Port::K, 2 }, { Port::K, 3 }, // 62-65 (A8-A11)
+		{ Port::K, 4 }, { Port::K, 5 }, { Port::K, 6 }, { Port::K, 7 }, // 66-69 (A12-A15)
+	};
+}
+
+// Port pin by its number on the Arduino Mega board
+template<uint8_t pin>
+using MegaPin = PortPin<detail::kMegaPins[pin].port, detail::kMegaPins[pin].bit>;
+
+// Set of pins, possibly spread over several ports, written together.
+// Masks are resolved at compile time, so writing the whole group takes one read-modify-write for each
+// port the group uses, no matter how many pins it has.
+// Pins are selected with a bit mask: Bit i selects the i-th pin of the group.
+template<class... Pins>
+struct PortGroup
+{
+	static_assert(sizeof...(Pins) <= 8);
+	static constexpr uint8_t kAll = uint8_t((1 << sizeof...(Pins)) - 1);
+
+	static void setOutput()
+	{
+		forEachPort([](auto port) {
+			constexpr Port p = decltype(port)::value;
+			directionRegister<p>() |= mask<p>(kAll);
+		});
+	}
+
+	// Raise the selected pins. Ports without selected pins aren't touched.
+	static void setHigh(uint8_t selection)
+	{
+		forEachPort([=](auto port) {
+			constexpr Port p = decltype(port)::value;
+			const uint8_t bits = mask<p>(selection);
+			if (bits)
+				portRegister<p>() |= bits;
+		});
+	}
+
+	// Lower the selected pins. Ports without selected pins aren't touched.
+	static void setLow(uint8_t selection)
+	{
+		forEachPort([=](auto port) {
+			constexpr Port p = decltype(port)::value;
+			const uint8_t bits = mask<p>(selection);
+			if (bits)
+				portRegister<p>() &= uint8_t(~bits);
+		});
+	}
+
+	// Raise the selected pins and lower the rest
+	static void write(uint8_t selection)
+	{
+		forEachPort([=](auto port) {
+			constexpr Port p = decltype(port)::value;
+			auto& reg = portRegister<p>();
+			reg = uint8_t((reg & ~mask<p>(kAll)) | mask<p>(selection));
+		});
+	}
+
+	// Bits of the given port that belong to selected pins
+	template<Port port>
+	static uint8_t mask(uint8_t selection)
+	{
+		return maskImpl<port>(selection, std::index_sequence_for<Pins...>());
+	}
+
+private:
+	template<Port port, size_t... I>
+	static uint8_t maskImpl(uint8_t selection, std::index_sequence<I...>)
+	{
+		return uint8_t((((Pins::kPort == port) && (selection & (1 << I)) ? Pins::kMask : 0) | ...));
+	}
+
+	static constexpr bool usesPort(Port port)
+	{
+		return ((Pins::kPort == port) || ...);
+	}
+
+	// Call op with an std::integral_constant for every port used by the group
+	template<class Op>
+	static void forEachPort(Op op)
+	{
+		[&]<size_t... P>(std::index_sequence<P...>) {
+			(visitPort<Port(P)>(op), ...);
+		}(std::make_index_sequence<size_t(Port::Count)>());
+	}
+
+	template<Port port, class Op>
+	static void visitPort(Op& op)
+	{
+		if constexpr (usesPort(port))
+			op(std::integral_constant<Port, port>());
+	}
+};
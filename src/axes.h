@@ -0,0 +1,96 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include "HardwareConfig.h"
+#include "stepperDriver.h"
+
+// Axis descriptors. The motion controller and the planner take the list of axes of the machine as a
+// template parameter pack, and generate the code for each of them at compile time.
+// A descriptor names the driver and endstop of the axis and its kinematic limits:
+//   Driver: StepperDriver type
+//   Endstop: MinEndstop at the low end of the axis, or NoEndstop
+//   kSteps_mm, kMaxSpeed, kMaxAccel, kMaxJerk: Limits along the axis
+//   kMinStepPeriod: Shortest time between steps, from the max speed (see minStepPeriod)
+// The first three axes of a machine are always X, Y and Z. G-code coordinates and arcs refer to them.
+
+// Time between steps of an axis at its max speed. It limits the duration of moves and the step rate.
+template<class Speed, class Steps_mm>
+constexpr us_step minStepPeriod(Speed maxSpeed, Steps_mm steps_mm)
+{
+	return us_step(int32_t(1'000'000.f / (maxSpeed * steps_mm).count() + 0.5f));
+}
+
+// Endstop switch on an input pin, triggered at the low end of the axis travel (see kEndstopInverted).
+// The pin must be able to raise an interrupt (see PortPin::enableInterrupt), and the interrupt handler
+// must call MotionController::endstopInterrupt for the axis.
+template<class Pin_>
+struct MinEndstop
+{
+	using Pin = Pin_;
+	static constexpr bool kPresent = true;
+
+	static void init()
+	{
+		Pin::setInput(true);
+		Pin::enableInterrupt(kEndstopInverted ? PinEdge::falling : PinEdge::rising);
+	}
+	static bool triggered() { return Pin::read() != kEndstopInverted; }
+};
+
+// Axes without an endstop can't home. Their position is taken as the origin instead.
+struct NoEndstop
+{
+	static constexpr bool kPresent = false;
+
+	static void init() {}
+	static bool triggered() { return false; }
+};
+
+struct XAxis
+{
+	using Driver = XAxisStepper;
+	using Endstop = MinEndstop<MegaPin<3>>;
+	static constexpr auto kSteps_mm = kSteps_mmX;
+	static constexpr auto kMaxSpeed = kMaxSpeedX;
+	static constexpr auto kMaxAccel = kMaxAccelX;
+	static constexpr auto kMaxJerk = kMaxJerkX;
+	static constexpr auto kMinStepPeriod = minStepPeriod(kMaxSpeed, kSteps_mm);
+};
+
+struct YAxis
+{
+	using Driver = YAxisStepper;
+	using Endstop = MinEndstop<MegaPin<14>>;
+	static constexpr auto kSteps_mm = kSteps_mmY;
+	static constexpr auto kMaxSpeed = kMaxSpeedY;
+	static constexpr auto kMaxAccel = kMaxAccelY;
+	static constexpr auto kMaxJerk = kMaxJerkY;
+	static constexpr auto kMinStepPeriod = minStepPeriod(kMaxSpeed, kSteps_mm);
+};
+
+struct ZAxis
+{
+	using Driver = ZAxisStepper;
+	using Endstop = MinEndstop<MegaPin<18>>;
+	static constexpr auto kSteps_mm = kSteps_mmZ;
+	static constexpr auto kMaxSpeed = kMaxSpeedZ;
+	static constexpr auto kMaxAccel = kMaxAccelZ;
+	static constexpr auto kMaxJerk = kMaxJerkZ;
+	static constexpr auto kMinStepPeriod = minStepPeriod(kMaxSpeed, kSteps_mm);
+};
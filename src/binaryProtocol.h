@@ -0,0 +1,259 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "GCode.h"
+
+// Compact binary encoding of G-code operations, for hosts that need more throughput than text allows.
+// Programs that start with "%B" instead of "%" switch to binary frames after the end of that line.
+//
+// Frame layout:
+//   kSync
+//   code: G codes as [0,99], M codes as [100,199] (see GCodeOperation). kEndOfProgram leaves binary mode.
+//   header: Low nibble is a mask of the arguments present (X,Y,Z,F). High nibble is the sequence number.
+//   extended mask: Only in arc moves (G2, G3). Mask of the arc arguments present (I,J,K,R).
+//   arguments: Present arguments in order, zigzag encoded varints, little-endian groups of 7 bits.
+//   crc: CRC-16/CCITT of everything after kSync, little-endian.
+//
+// A "G1 X80 Y80" move takes 11 bytes. Every frame is answered with "ok", or with "resend <seq>" if it
+// was corrupt or out of order, where seq is the sequence number the firmware expects next.
+namespace binaryProtocol
+{
+	constexpr uint8_t kSync = 0xa5;
+	constexpr uint8_t kEndOfProgram = 0xff;
+	constexpr uint8_t kSequenceMask = 0xf;
+	constexpr size_t kMaxFrameSize = 1 + 1 + 1 + 1 + GCodeOperation::kNumArgs * 5 + 2;
+
+	// Codes of the operations that take arguments past F
+	constexpr bool hasExtendedArguments(uint8_t code)
+	{
+		return code == GCodeOperation::CodeOffsetG + 2 || code == GCodeOperation::CodeOffsetG + 3;
+	}
+
+	inline uint16_t crc16Update(uint16_t crc, uint8_t data)
+	{
+		crc ^= uint16_t(data) << 8;
+		for (uint8_t i = 0; i < 8; ++i)
+			crc = (crc & 0x8000) ? uint16_t((crc << 1) ^ 0x1021) : uint16_t(crc << 1);
+		return crc;
+	}
+
+	constexpr uint16_t kCrcInit = 0xffff;
+
+	inline uint32_t zigzag(int32_t x) { return (uint32_t(x) << 1) ^ uint32_t(x >> 31); }
+	inline int32_t unzigzag(uint32_t x) { return int32_t(x >> 1) ^ -int32_t(x & 1); }
+
+	// Writes a frame for the given operation into out, which must fit kMaxFrameSize bytes. Returns the frame size.
+	inline size_t encode(const GCodeOperation& op, uint8_t sequence, uint8_t* out)
+	{
+		size_t n = 0;
+		out[n++] = kSync;
+		if (op.address == 'M')
+			out[n++] = uint8_t(op.opCode + GCodeOperation::CodeOffsetM);
+		else if (op.address == 'G')
+			out[n++] = uint8_t(op.opCode + GCodeOperation::CodeOffsetG);
+		else
+			out[n++] = kEndOfProgram;
+		const bool extended = hasExtendedArguments(out[n - 1]);
+
+		uint8_t mask = 0;
+		for (uint8_t i = 0; i < (extended ? 8 : 4); ++i)
+			if (op.argument[i] != GCodeOperation::kEmptyArg)
+				mask |= 1 << i;
+		out[n++] = uint8_t((mask & 0xf) | ((sequence & kSequenceMask) << 4));
+		if (extended)
+			out[n++] = uint8_t(mask >> 4);
+
+		for (uint8_t i = 0; i < 8; ++i)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+			uint32_t value = zigzag(op.argument[i]);
+			while (value >= 0x80)
+			{
+				out[n++] = uint8_t(value | 0x80);
+				value >>= 7;
+			}
+			out[n++] = uint8_t(value);
+		}
+
+		uint16_t crc = kCrcInit;
+		for (size_t i = 1; i < n; ++i)
+			crc = crc16Update(crc, out[i]);
+		out[n++] = uint8_t(crc);
+		out[n++] = uint8_t(crc >> 8);
+		return n;
+	}
+
+	// Incremental frame decoder. Fed one byte at a time, it builds the operation in place without
+	// buffering the frame.
+	class Decoder
+	{
+	public:
+		enum class Result : uint8_t
+		{
+			pending, // Frame not complete yet
+			operation, // op() holds a new operation
+			endOfProgram,
+			duplicate, // Repeated frame, already received. Acknowledge but don't execute.
+			error, // Corrupt or out of order frame. Ask for a resend from expectedSequence()
+		};
+
+		void reset()
+		{
+			m_state = State::sync;
+			m_expectedSequence = 0;
+		}
+
+		Result push(uint8_t c)
+		{
+			switch (m_state)
+			{
+			case State::sync:
+				if (c == kSync)
+				{
+					m_crc = kCrcInit;
+					m_state = State::code;
+				}
+				return Result::pending;
+			case State::code:
+				m_crc = crc16Update(m_crc, c);
+				m_code = c;
+				m_op = {};
+				if (c < GCodeOperation::CodeOffsetM)
+				{
+					m_op.address = 'G';
+					m_op.opCode = uint8_t(c - GCodeOperation::CodeOffsetG);
+				}
+				else if (c < 2 * GCodeOperation::CodeOffsetM)
+				{
+					m_op.address = 'M';
+					m_op.opCode = uint8_t(c - GCodeOperation::CodeOffsetM);
+				}
+				else if (c != kEndOfProgram)
+					return fail(); // Unknown code
+				m_state = State::header;
+				return Result::pending;
+			case State::header:
+				m_crc = crc16Update(m_crc, c);
+				m_header = c;
+				m_mask = c & 0xf;
+				m_argPos = 0;
+				if (hasExtendedArguments(m_code))
+				{
+					m_state = State::extendedMask;
+					return Result::pending;
+				}
+				return nextArgument();
+			case State::extendedMask:
+				m_crc = crc16Update(m_crc, c);
+				m_mask |= uint8_t(c << 4);
+				return nextArgument();
+			case State::argument:
+				m_crc = crc16Update(m_crc, c);
+				if (m_shift == 28 && (c & 0x7f) > 0xf)
+					return fail(); // Only 4 bits of the fifth group fit in 32 bits
+				m_value |= uint32_t(c & 0x7f) << m_shift;
+				m_shift += 7;
+				if (c & 0x80)
+				{
+					if (m_shift >= 35)
+						return fail(); // Overlong varint
+					return Result::pending;
+				}
+				if (unzigzag(m_value) == GCodeOperation::kEmptyArg)
+					return fail(); // Not a value, but the marker of missing arguments
+				m_op.argument[m_argPos++] = unzigzag(m_value);
+				return nextArgument();
+			case State::crcLow:
+				m_receivedCrc = c;
+				m_state = State::crcHigh;
+				return Result::pending;
+			case State::crcHigh:
+				m_receivedCrc |= uint16_t(c) << 8;
+				m_state = State::sync;
+				return endFrame();
+			}
+			return Result::pending;
+		}
+
+		const GCodeOperation& op() const { return m_op; }
+		uint8_t expectedSequence() const { return m_expectedSequence; }
+
+	private:
+		Result nextArgument()
+		{
+			while (m_argPos < 8 && !(m_mask & (1 << m_argPos)))
+				++m_argPos;
+			if (m_argPos == 8)
+			{
+				m_state = State::crcLow;
+				return Result::pending;
+			}
+			m_value = 0;
+			m_shift = 0;
+			m_state = State::argument;
+			return Result::pending;
+		}
+
+		Result endFrame()
+		{
+			if (m_receivedCrc != m_crc)
+				return Result::error;
+
+			const uint8_t sequence = m_header >> 4;
+			if (sequence == ((m_expectedSequence - 1) & kSequenceMask))
+				return Result::duplicate;
+			if (sequence != m_expectedSequence)
+				return Result::error;
+
+			m_expectedSequence = (m_expectedSequence + 1) & kSequenceMask;
+			return m_code == kEndOfProgram ? Result::endOfProgram : Result::operation;
+		}
+
+		Result fail()
+		{
+			m_state = State::sync;
+			return Result::error;
+		}
+
+		enum class State : uint8_t
+		{
+			sync,
+			code,
+			header,
+			extendedMask,
+			argument,
+			crcLow,
+			crcHigh,
+		} m_state = State::sync;
+
+		GCodeOperation m_op = {};
+		uint8_t m_code = 0;
+		uint8_t m_header = 0;
+		uint8_t m_mask = 0; // Arguments present
+		uint8_t m_argPos = 0;
+		uint8_t m_shift = 0;
+		uint32_t m_value = 0;
+		uint16_t m_crc = kCrcInit;
+		uint16_t m_receivedCrc = 0;
+		uint8_t m_expectedSequence = 0;
+	};
+}
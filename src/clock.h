@@ -19,6 +19,7 @@
 
 #include <cstddef>
 #include <chrono>
+#include <cstdint>
 
 #ifdef WIN32
 template<class baseClock>
@@ -42,12 +43,11 @@ struct AtmegaEmulatedClock
 		constexpr uint32_t timerCapacity = 256;
 
 		// Use time from first call as an approximation to time from start in the device
-		using implClock = std::chrono::steady_clock;
-		static auto t0 = implClock::now();
-		auto timeFromStart = implClock::now() - t0;
+		static auto t0 = baseClock::now();
+		auto timeFromStart = baseClock::now() - t0;
 
 		// Emulate the state of internal variables used to track timer overflows in arduino
-		const uint64_t nsFromStart = timeFromStart.count();
+		const uint64_t nsFromStart = std::chrono::duration_cast<std::chrono::nanoseconds>(timeFromStart).count();
 		const uint64_t ticksFromStart = nsFromStart * 16 / 1000; // 16 ticks per microsecond
 		const uint32_t timer0_overflow_count = uint32_t(ticksFromStart / (timerDiv * timerCapacity));
 		const uint8_t tcnt = uint8_t(ticksFromStart/timerDiv); // Timer counter register
@@ -60,10 +60,11 @@ struct AtmegaEmulatedClock
 
 using RealTimeClock = AtmegaEmulatedClock<std::chrono::steady_clock>;
 
+// Virtual time. It only moves when currentTime is advanced, one cpu cycle at a time (see sitl::spendCycles).
 struct MockClockSrc
 {
-	using rep = RealTimeClock::rep;
-	using period = std::chrono::steady_clock::period;
+	using rep = int64_t;
+	using period = std::ratio<1, 16'000'000>; // Atmega2560 cpu cycles
 	using duration = std::chrono::duration<rep, period>;
 	using time_point = std::chrono::time_point<MockClockSrc>;
 
@@ -78,7 +79,11 @@ struct MockClockSrc
 };
 using MockClock = AtmegaEmulatedClock<MockClockSrc>;
 
-using SystemClock = AtmegaEmulatedClock<std::chrono::steady_clock>;;
+#ifdef MOCK_CLOCK
+using SystemClock = MockClock;
+#else
+using SystemClock = AtmegaEmulatedClock<std::chrono::steady_clock>;
+#endif
 #else
 struct SystemClock
 {
@@ -18,21 +18,106 @@
 
 #pragma once
 
+#include <math.h>
+#include "arcGenerator.h"
 #include "GCode.h"
 #include "HardwareConfig.h"
 
+// State of a G-code program carried from one operation to the next
+struct GCodeModalState
+{
+	ArcPlane arcPlane = ArcPlane::xy; // G17, G18, G19
+	// Feed moves run at full speed until the program sets a feed rate
+	um_second feedRate = um_second(0);
+};
+
+// F sets the feed rate of the operation and the ones after it, in mm/min
+inline void updateFeedRate(GCodeModalState& state, const GCodeOperation& op)
+{
+	const int32_t feed = op.argument[3];
+	if (feed != GCodeOperation::kEmptyArg && feed > 0)
+		state.feedRate = um_second(feed / 60); // um/min to um/s
+}
+
+// Convert a coordinate argument to the closest motor step
+inline MotorSteps argToSteps(int32_t argument, int32_t steps_mm)
+{
+	const int64_t scaledSteps = int64_t(argument) * steps_mm;
+	const int32_t half = GCodeOperation::kArgScale / 2;
+	return MotorSteps(int32_t((scaledSteps + (scaledSteps < 0 ? -half : half)) / GCodeOperation::kArgScale));
+}
+
+// Target of a move. Axes without arguments stay where they are.
 template<class MotionController>
-void G1_linearMove(MotionController& motionController, const GCodeOperation& op)
+auto moveTarget(const MotionController& motionController, const GCodeOperation& op)
 {
-	auto targetPos = motionController.getMotorPositions();
+	auto targetPos = motionController.getPlannedPositions();
 	if (op.argument[0] != MotionController::kUnknownPos)
-		targetPos.x() = MotorSteps(op.argument[0] * kSteps_mmX.count());
+		targetPos.x() = argToSteps(op.argument[0], kSteps_mmX.count());
 
 	if (op.argument[1] != MotionController::kUnknownPos)
-		targetPos.y() = MotorSteps(op.argument[1] * kSteps_mmY.count());
+		targetPos.y() = argToSteps(op.argument[1], kSteps_mmY.count());
 
 	if (op.argument[2] != MotionController::kUnknownPos)
-		targetPos.z() = MotorSteps(op.argument[2] * kSteps_mmZ.count());
+		targetPos.z() = argToSteps(op.argument[2], kSteps_mmZ.count());
+	return targetPos;
+}
+
+// Rapid move, as fast as the axes allow
+template<class MotionController>
+void G0_rapidMove(MotionController& motionController, const GCodeOperation& op)
+{
+	motionController.setLinearTarget(moveTarget(motionController, op), MotionController::kRapidFeed);
+}
+
+template<class MotionController>
+void G1_linearMove(MotionController& motionController, const GCodeOperation& op, const GCodeModalState& state)
+{
+	motionController.setLinearTarget(moveTarget(motionController, op), state.feedRate);
+}
+
+// Arc move. The center is either given as an offset from the start (I,J,K), or found from the radius (R).
+// Positive radii take the short way around, and negative ones the long way. Radii too short to reach the
+// target are taken as half circles.
+template<class MotionController>
+void G2G3_arcMove(MotionController& motionController, const GCodeOperation& op, const GCodeModalState& state, bool clockwise)
+{
+	const ArcPlane plane = state.arcPlane;
+	const auto targetPos = moveTarget(motionController, op);
+	const auto& startPos = motionController.getPlannedPositions();
+	const int32_t steps_mm[3] = { kSteps_mmX.count(), kSteps_mmY.count(), kSteps_mmZ.count() };
+	const ArcAxes axes = arcAxes(plane);
+	const uint8_t planeAxes[2] = { axes.first, axes.second };
+
+	float start[2];
+	float center[2];
+	for (int i = 0; i < 2; ++i)
+	{
+		const uint8_t axis = planeAxes[i];
+		start[i] = float(startPos[axis].count()) / steps_mm[axis];
+		const int32_t offset = op.argument[4 + axis]; // I,J,K
+		center[i] = start[i] + (offset != GCodeOperation::kEmptyArg ? float(offset) / GCodeOperation::kArgScale : 0.f);
+	}
+
+	const int32_t radiusArg = op.argument[7];
+	if (radiusArg != GCodeOperation::kEmptyArg)
+	{
+		const float x = float(targetPos[planeAxes[0]].count()) / steps_mm[planeAxes[0]] - start[0];
+		const float y = float(targetPos[planeAxes[1]].count()) / steps_mm[planeAxes[1]] - start[1];
+		const float radius = float(radiusArg) / GCodeOperation::kArgScale;
+		const float chord = sqrtf(x * x + y * y);
+		if (chord > 0)
+		{
+			// Distance from the center to the middle of the chord, over half the chord
+			float h = -sqrtf(max(4 * radius * radius - x * x - y * y, 0.f)) / chord;
+			if (!clockwise)
+				h = -h;
+			if (radius < 0)
+				h = -h;
+			center[0] = start[0] + 0.5f * (x - y * h);
+			center[1] = start[1] + 0.5f * (y + x * h);
+		}
+	}
 
-	motionController.setLinearTarget(targetPos);
+	motionController.setArcTarget(targetPos, center, plane, clockwise, state.feedRate);
 }
\ No newline at end of file
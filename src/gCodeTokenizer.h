@@ -0,0 +1,252 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <cstdint>
+#include "GCode.h"
+
+// Streaming tokenizer for the lines of a text G-code program.
+// The state machine advances with every byte and writes arguments straight into the operation being
+// built, so lines are never stored, and can be of any length.
+class GCodeTokenizer
+{
+public:
+	enum class Result : uint8_t
+	{
+		pending, // Line not complete yet
+		operation, // End of a line. op() holds its operation, with a null address on empty lines.
+		error, // End of a line with syntax errors
+		debug, // Debug request ('D')
+		endOfProgram, // End of the line with the closing '%'
+	};
+
+	// Arguments are parsed as magnitudes and rejected once they don't fit in 31 bits, so the lowest
+	// value is -kMaxArg, and a parsed argument can never be kEmptyArg.
+	static constexpr uint32_t kMaxArg = 0x7fffffff;
+
+	void reset()
+	{
+		m_state = State::address;
+		m_op = {};
+		m_lineEnded = false;
+	}
+
+	Result push(char c)
+	{
+		if (m_lineEnded)
+		{
+			m_op = {};
+			m_lineEnded = false;
+		}
+
+		switch (m_state)
+		{
+		case State::comment:
+			return c == '\n' ? endLine(Result::operation) : Result::pending;
+		case State::skipLine:
+			return c == '\n' ? endLine(Result::error) : Result::pending;
+		case State::programEnd:
+			if (c != '\n')
+				return Result::pending;
+			endLine(Result::operation);
+			return Result::endOfProgram;
+		default:
+			break;
+		}
+
+		switch (c)
+		{
+		case '%':
+			m_state = State::programEnd;
+			return Result::pending;
+		case '\r': // Same as comment, just ignore till the end of the line
+		case ';':
+			if (!endWord())
+				return fail();
+			m_state = State::comment;
+			return Result::pending;
+		case '\n':
+			return endLine(endWord() ? Result::operation : Result::error);
+		default:
+			return parseOpCodeChar(c);
+		}
+	}
+
+	const GCodeOperation& op() const { return m_op; }
+
+private:
+	Result parseOpCodeChar(char c)
+	{
+		switch (m_state)
+		{
+		case State::address:
+			switch (c)
+			{
+			case ' ':
+				return Result::pending; // Ignore white space at the start of the line
+			case 'G':
+			case 'M':
+				m_state = State::code;
+				m_op.address = c;
+				m_digits = false;
+				return Result::pending;
+			case 'D':
+				return Result::debug;
+			default:
+				return fail();
+			}
+		case State::code:
+			if (c >= '0' && c <= '9')
+			{
+				if (m_op.opCode > 9) // Codes go up to 99, see GCodeOperation
+					return fail();
+				m_op.opCode = 10 * m_op.opCode + (c - '0');
+				m_digits = true;
+				return Result::pending;
+			}
+			return endWord() ? parseOpCodeChar(c) : fail(); // Arguments don't need a separating space
+		case State::arguments:
+			switch (c)
+			{
+			case ' ':
+				return Result::pending; // Ignore extra spaces
+			case 'X':
+				m_argPos = 0;
+				break;
+			case 'Y':
+				m_argPos = 1;
+				break;
+			case 'Z':
+				m_argPos = 2;
+				break;
+			case 'F':
+				m_argPos = 3;
+				break;
+			case 'I':
+				m_argPos = 4;
+				break;
+			case 'J':
+				m_argPos = 5;
+				break;
+			case 'K':
+				m_argPos = 6;
+				break;
+			case 'R':
+				m_argPos = 7;
+				break;
+			default:
+				return fail();
+			}
+			m_state = State::integer;
+			m_argSign = 1;
+			m_argMagnitude = 0;
+			m_digits = false;
+			return Result::pending;
+		case State::integer:
+			if (c == '-' && m_argSign > 0 && !m_digits) // Sign only goes before the first digit
+				m_argSign = -1;
+			else if (c >= '0' && c <= '9')
+			{
+				if (m_argMagnitude > kMaxArg / 10 || !setArgMagnitude(m_argMagnitude * 10 + uint32_t(c - '0') * GCodeOperation::kArgScale))
+					return fail();
+			}
+			else if (c == '.')
+			{
+				m_decimalScale = GCodeOperation::kArgScale / 10;
+				m_state = State::decimal;
+			}
+			else
+				return endWord() ? parseOpCodeChar(c) : fail();
+			return Result::pending;
+		case State::decimal:
+			if (c >= '0' && c <= '9')
+			{
+				if (m_decimalScale > 0)
+				{
+					if (!setArgMagnitude(m_argMagnitude + uint32_t(c - '0') * m_decimalScale))
+						return fail();
+				}
+				else if (m_decimalScale == 0)
+				{
+					// Round to the closest representable value
+					if (!setArgMagnitude(m_argMagnitude + (c >= '5' ? 1 : 0)))
+						return fail();
+				}
+				m_decimalScale = m_decimalScale > 0 ? m_decimalScale / 10 : -1; // Digits past the first one beyond precision are ignored
+				return Result::pending;
+			}
+			return endWord() ? parseOpCodeChar(c) : fail();
+		default:
+			return fail();
+		}
+	}
+
+	// Codes and arguments need at least one digit. For arguments, it can be before or after the decimal point.
+	bool endWord()
+	{
+		if (m_state != State::code && m_state != State::integer && m_state != State::decimal)
+			return true;
+		m_state = State::arguments;
+		return m_digits;
+	}
+
+	bool setArgMagnitude(uint32_t magnitude)
+	{
+		if (magnitude > kMaxArg)
+			return false;
+		m_argMagnitude = magnitude;
+		m_digits = true;
+		m_op.argument[m_argPos] = m_argSign * int32_t(magnitude);
+		return true;
+	}
+
+	// Syntax errors are reported at the end of their line, so that every line gets a single reply
+	Result fail()
+	{
+		m_state = State::skipLine;
+		return Result::pending;
+	}
+
+	Result endLine(Result result)
+	{
+		m_state = State::address;
+		m_lineEnded = true;
+		return result;
+	}
+
+	enum class State : uint8_t
+	{
+		comment,
+		skipLine, // Rest of a line with errors
+		programEnd, // Rest of the line with the closing '%'
+		// Operation
+		address,
+		code,
+		arguments,
+		integer,
+		decimal,
+	} m_state = State::address;
+
+	GCodeOperation m_op = {};
+	bool m_lineEnded = false;
+	bool m_digits = false; // The code or argument being parsed has any digits
+	int8_t m_argSign = 1;
+	int8_t m_argPos = 0;
+	uint32_t m_argMagnitude = 0;
+	int32_t m_decimalScale = 0; // Weight of the next decimal digit
+};
@@ -24,10 +24,15 @@
 #include <utility>
 #include <hal/boards/arduinomega2560.h>
 #include "AnalogJoystick.h"
+#include "binaryProtocol.h"
 #include "motionController.h"
 #include "GCode.h"
 #include "gCodeInstructions.h"
+#include "gCodeTokenizer.h"
 #include "clock.h"
+#include "perfCounters.h"
+#include "serialPort.h"
+#include "stepTimer.h"
 
 using namespace etl::hal;
 using namespace etl;
@@ -40,264 +45,282 @@ LedPin gLed;
 
 AnalogJoystick<A5, A10, Pin44> gLeftStick;
 
-etl::FixedRingBuffer<char,128> pendingMessage;
-
 etl::FixedRingBuffer<GCodeOperation, 8> operationsBuffer;
-MotionController<SystemClock> gMotionController;
+GCodeModalState gModalState;
+MotionController<SystemClock, XAxis, YAxis, ZAxis> gMotionController;
 
-void signalError()
+// Step generation runs entirely off the step timer. The main loop only feeds new targets
+// to the motion controller and starts the timer.
+ISR(TIMER1_COMPA_vect)
 {
-	pendingMessage.clear();
-	gMotionController.stop();
-	Serial.println("error");
-}
+	// The counter restarted at the compare match, so it holds how late this event runs
+	gPerfCounters.stepLateness.add(uint16_t(StepTimer::sinceEvent().count()));
+	gMotionController.step();
+	const bool idle = gMotionController.idle();
+	if (!idle)
+		StepTimer::setPeriod(gMotionController.tickPeriod());
 
-class OpCodeParser
-{
-public:
-	void parseOpCode()
+	// Step pins went high at the start of the event. The rest of the work here counts towards the pulse width.
+	bool pulseEnded = true;
+	if constexpr (kSplitStepPulses)
 	{
-		// We shouldn't be processing empty lines.
-		// That could lead to us pushing garbage to the execution queue, or acknowleding commands prematurely
-		assert(!pendingMessage.empty());
-
-		operationsBuffer.push_back({});
-		GCodeOperation& instruction = operationsBuffer.back();
-		instruction.address = {};
-		instruction.opCode = {};
-		int8_t argSign = 1;
-		int8_t argPos = 0;
-
-		for (size_t i = 0; i < pendingMessage.size(); ++i)
+		constexpr auto pulseWidth = std::chrono::ceil<StepTimer::duration>(decltype(gMotionController)::kStepPulseWidth);
+		if (StepTimer::sinceEvent() >= pulseWidth)
+			gMotionController.endStepPulses();
+		else
 		{
-			char c = pendingMessage[i];
-			switch (m_state)
-			{
-			case State::address:
-				switch (c)
-				{
-				case ' ':
-					break; // Ignore white space at the start of the line
-				case 'G':
-				case 'M':
-					m_state = State::code;
-					instruction.address = c;
-					break;
-
-				case 'D': // Debug
-					gMotionController.printState();
-					break;
-				default:
-					signalError();
-					return;
-				}
-				break;
-			case State::code:
-				if (c >= '0' && c <= '9')
-					instruction.opCode = 10 * instruction.opCode + (c - '0');
-				else if (c == ' ')
-				{
-					m_state = State::arguments;
-				}
-				else
-				{
-					signalError();
-					return;
-				}
-				break;
-			case State::arguments:
-				if (c == ' ')
-					break; // Ignore extra spaces
-				switch (c)
-				{
-				case 'X':
-					argPos = 0;
-					break;
-				case 'Y':
-					argPos = 1;
-					break;
-				case 'Z':
-					argPos = 2;
-					break;
-				case 'F':
-					argPos = 3;
-					break;
-				default:
-					signalError();
-					return;
-				}
-				m_state = State::integer;
-				argSign = 1;
-				instruction.argument[argPos] = 0;
-				break;
-			case State::integer:
-				if (c == '-')
-					argSign = -1;
-				else if (c >= '0' && c <= '9')
-				{
-					instruction.argument[argPos] *= 10;
-					instruction.argument[argPos] += (c - '0') * argSign;
-				}
-				else if (c == '.')
-				{
-					signalError(); // Decimal points not yet supported
-					m_state = State::decimal;
-				}
-				else if (c == ' ')
-					m_state = State::arguments;
-				else
-				{
-					signalError();
-					return;
-				}
-				break;
-			case State::decimal:
-				signalError(); // Not yet supported
-				return;
-			}
+			StepTimer::setPulseEnd(pulseWidth);
+			pulseEnded = false;
 		}
-		// Clear message and acknowledge
-		pendingMessage.clear();
-		Serial.println("ok");
 	}
+	// The last pulse must end too, so without more events the timer only stops once it has
+	if (idle && pulseEnded)
+		StepTimer::stop();
+}
 
-private:
-	enum class State
-	{
-		address,
-		code,
-		arguments,
-		integer,
-		decimal,
-	} m_state = State::address;
-};
+ISR(TIMER1_COMPB_vect)
+{
+	gMotionController.endStepPulses();
+	StepTimer::clearPulseEnd();
+	if (gMotionController.idle())
+		StepTimer::stop();
+}
+
+// Endstop interrupts (see axes.h). Pins 3 and 18 have external interrupts, pin 14 a pin change one.
+ISR(INT5_vect)
+{
+	gMotionController.endstopInterrupt<XAxis>();
+}
+
+ISR(PCINT1_vect)
+{
+	gMotionController.endstopInterrupt<YAxis>();
+}
+
+ISR(INT3_vect)
+{
+	gMotionController.endstopInterrupt<ZAxis>();
+}
+
+void signalError()
+{
+	gMotionController.stop();
+	gSerial.println("error");
+}
+
+// Max time spent parsing input on every pass of the main loop.
+// Bytes arrive into the RX buffer from an interrupt, so they can be parsed in batches.
+constexpr auto kParseBudget = 500us;
 
+// Streaming G-code parser.
+// Text lines go through GCodeTokenizer, byte by byte, so they are never stored. Operations are queued at
+// the end of their line. Programs starting with "%B" are sent in binary frames instead (see binaryProtocol.h).
 class GCodeParser
 {
 public:
+	// Parse buffered input until it runs out, the operations buffer fills up, or the time budget is spent
 	void parseInput()
 	{
-		if (m_state == State::full)
+		const auto t0 = micros();
+		while (gSerial.available() && !operationsBuffer.full())
 		{
-			if (operationsBuffer.full())
+			parseChar(gSerial.read());
+			++gPerfCounters.parsedBytes;
+			if (micros() - t0 >= uint32_t(kParseBudget.count()))
 				return;
-			m_state = State::message; // No longer full, can proceed to parse input messages
 		}
-		// Parse one character at a time and yield to increase motor control throughput
-		if (!Serial.available())
-			return;
-		char c;
-		Serial.readBytes(&c, 1);
+	}
+
+private:
+	void parseChar(char c)
+	{
 		switch (m_state)
 		{
 		case State::outOfProgram:
-		{
 			if (c == '%')
 			{
-				m_state = State::comment; // Comment out the rest of the line
+				m_state = State::programStart;
 				gMotionController.start();
 				gLed.setHigh();
 			}
-			break;
+			return;
+		case State::programStart:
+			m_binary = c == 'B';
+			m_decoder.reset();
+			m_tokenizer.reset();
+			m_state = State::programHeader;
+			[[fallthrough]];
+		case State::programHeader: // Comment out the rest of the line
+			if (c == '\n')
+				endLine(true);
+			return;
+		case State::binary:
+			parseBinary(uint8_t(c));
+			return;
+		case State::text:
+			parseText(c);
+			return;
 		}
-		case State::message:
+	}
+
+	void parseText(char c)
+	{
+		using Result = GCodeTokenizer::Result;
+		switch (m_tokenizer.push(c))
 		{
-			switch (c)
-			{
-			case '%':
-				m_state = State::outOfProgram;
-				gMotionController.stop();
-				gLed.setLow();
-				break;
-			case '\r': // Same as comment, just ignore till the end of the line
-			case ';':
-				m_state = State::comment;
-				break;
-			case '\n':
-			{
-				OpCodeParser parser;
-				parser.parseOpCode();
-				break;
-			}
-			default:
-				pendingMessage.push_back(c);
-				break;
-			}
-			break;
+		case Result::pending:
+			return;
+		case Result::operation:
+			endLine(true);
+			return;
+		case Result::error:
+			endLine(false);
+			return;
+		case Result::debug:
+			gLog.beginReport();
+			gMotionController.printState(gLog);
+			gLog.print("rx:");
+			gLog.println(gSerial.rxFree());
+			gLog.endReport();
+			gPerfCounters.dump();
+			return;
+		case Result::endOfProgram:
+			gSerial.println("ok");
+			endProgram();
+			return;
+		}
+	}
+
+	// Every line of a program gets exactly one reply, once all its bytes are out of the RX buffer.
+	// Hosts can count the bytes of the lines not yet acknowledged, and keep sending as long as they fit in
+	// SerialPort::kRxCapacity, instead of waiting for each reply before sending the next line.
+	void endLine(bool valid)
+	{
+		const uint16_t droppedBytes = gSerial.droppedBytes();
+		if (droppedBytes != m_droppedBytes)
+		{
+			// The host overran the RX buffer, so this line may be missing bytes. Reject it, but keep the motors
+			// engaged, as the moves already queued are fine and the position must not be lost.
+			m_droppedBytes = droppedBytes;
+			gSerial.println("error");
 		}
-		case State::comment:
+		else if (!valid)
+			signalError();
+		else
 		{
-			if (c == '\n')
-			{
-				if (!pendingMessage.empty())
-				{
-					OpCodeParser parser;
-					parser.parseOpCode();
-				}
-				m_state = State::message;
-			}
-			break;
+			if (m_state == State::text && m_tokenizer.op().address)
+				operationsBuffer.push_back(m_tokenizer.op());
+			gSerial.println("ok");
 		}
+		m_state = m_binary ? State::binary : State::text;
+	}
+
+	void parseBinary(uint8_t c)
+	{
+		using Result = binaryProtocol::Decoder::Result;
+		switch (m_decoder.push(c))
+		{
+		case Result::pending:
+			return;
+		case Result::operation:
+			if (m_decoder.op().address)
+				operationsBuffer.push_back(m_decoder.op());
+			gSerial.println("ok");
+			return;
+		case Result::duplicate:
+			gSerial.println("ok");
+			return;
+		case Result::endOfProgram:
+			gSerial.println("ok");
+			endProgram();
+			return;
+		case Result::error:
+			gSerial.print("resend ");
+			gSerial.println(m_decoder.expectedSequence());
+			return;
 		}
 	}
-private:
+
+	void endProgram()
+	{
+		m_state = State::outOfProgram;
+		m_binary = false;
+		gMotionController.stop();
+		gLed.setLow();
+	}
+
 	enum class State
 	{
 		outOfProgram,
-		message,
-		comment,
-		full,
+		programStart, // Right after '%'
+		programHeader, // Rest of the line with the opening '%'
+		binary,
+		text,
 	} m_state = State::outOfProgram;
+
+	GCodeTokenizer m_tokenizer;
+	binaryProtocol::Decoder m_decoder;
+	bool m_binary = false;
+	uint16_t m_droppedBytes = 0;
 } gCodeParser;
 
 void setup() {
 	// Setup scheduler
 	// Setup serial port
-	Serial.begin(9600);
-	Serial.println("ready");
+	gSerial.begin(9600);
+	// Advertise the RX buffer capacity for hosts streaming with character counting
+	gSerial.print("ready rx:");
+	gSerial.println(SerialPort::kRxCapacity);
 	gLed.setLow();
+	gPerfCounters.reset();
 }
 
-bool moving = false;
-
 void loop()
 {
+	gPerfCounters.loopStarted();
+
+	// Diagnostics go out when the serial port has room for them
+	gLog.flush();
+
 	// Consume data from the serial port
 	gCodeParser.parseInput();
 
-	if (moving)
-	{
-		if (gMotionController.finished())
-			moving = false;
-		else
-		{
-			gMotionController.step();
-		}
-	}
-	else
+	// Keep the step engine fed
+	if (gMotionController.update())
+		StepTimer::start(gMotionController.tickPeriod());
+
+	// Queue new moves in the planner as long as there is room, so it can look ahead
+	if (!operationsBuffer.empty() && !gMotionController.full())
 	{
-		if (!operationsBuffer.empty())
-		{
-			auto op = operationsBuffer.front();
-			operationsBuffer.pop_front();
+		auto op = operationsBuffer.front();
+		operationsBuffer.pop_front();
 
-			if (op.address == 'G')
+		if (op.address == 'G')
+		{
+			updateFeedRate(gModalState, op);
+			if (op.opCode == 30) // GO to reference
 			{
-				if (op.opCode == 30) // GO to reference
-				{
-					gMotionController.goHome();
-					moving = true;
-				}
-				else if(op.opCode == 1) // Move
-				{
-					G1_linearMove(gMotionController, op);
-					moving = true;
-				}
+				gMotionController.goHome();
+			}
+			else if (op.opCode == 0) // Rapid move
+			{
+				G0_rapidMove(gMotionController, op);
+			}
+			else if(op.opCode == 1) // Move
+			{
+				G1_linearMove(gMotionController, op, gModalState);
+			}
+			else if (op.opCode == 2 || op.opCode == 3) // Arc, clockwise or counterclockwise
+			{
+				G2G3_arcMove(gMotionController, op, gModalState, op.opCode == 2);
+			}
+			else if (op.opCode >= 17 && op.opCode <= 19) // Arc plane
+			{
+				gModalState.arcPlane = ArcPlane(op.opCode - 17);
 			}
-
-
 		}
 	}
+	gPerfCounters.queueOccupancy(uint8_t(operationsBuffer.size()), uint8_t(gMotionController.plannedMoves()));
 
 	// Control motors
 	/*gLeftStick.read();
@@ -322,15 +345,60 @@ void loop()
 
 #ifdef SITL
 
+#include <cstring>
+#include "simulatedMachine.h"
+#include "stepTrace.h"
+#include "vcdRecorder.h"
+
 int main(int argc, char** argv)
 {
 	if (argc > 1)
 		Serial.InitFromFile(argv[1]);
+	// Carriages start some way off their endstops, so G30 has something to seek
+	sitl::simulateAxis<XAxis>(20 * kSteps_mmX.count());
+	sitl::simulateAxis<YAxis>(20 * kSteps_mmY.count());
+	sitl::simulateAxis<ZAxis>(20 * kSteps_mmZ.count());
+	// Further arguments like X35.5 inject an endstop event where that carriage is 35.5mm from its endstop.
+	// With STEP_TRACE, --trace=file records every step of the simulated axes (see stepTrace.h).
+	// --vcd=file dumps the step, dir and enable pins of the drivers into a VCD file (see vcdRecorder.h).
+	const float steps_mm[] = { float(kSteps_mmX.count()), float(kSteps_mmY.count()), float(kSteps_mmZ.count()) };
+	for (int i = 2; i < argc; ++i)
+	{
+		const int axis = argv[i][0] - 'X';
+		if (axis >= 0 && axis < 3)
+			sitl::simulatedAxes[axis].eventAt = int32_t(atof(argv[i] + 1) * steps_mm[axis]);
+		else if (strncmp(argv[i], "--vcd=", 6) == 0)
+		{
+			sitl::dumpAxisPins<XAxis>("x");
+			sitl::dumpAxisPins<YAxis>("y");
+			sitl::dumpAxisPins<ZAxis>("z");
+			if (!sitl::vcd::start(argv[i] + 6))
+			{
+				std::cerr << "can't write " << argv[i] + 6 << "\n";
+				return 1;
+			}
+		}
+#ifdef STEP_TRACE
+		else if (strncmp(argv[i], "--trace=", 8) == 0 && !sitl::stepTrace::start(argv[i] + 8, 3))
+		{
+			std::cerr << "can't write " << argv[i] + 8 << "\n";
+			return 1;
+		}
+#endif
+	}
 	// Reset system clock
 	SystemClock::now();
 	setup();
-	for(;;)
+	// Estimated cost of a pass of the main loop on the atmega, so simulations keep a realistic loop rate
+	constexpr uint64_t kLoopCycles = 800;
+	for (;;)
+	{
 		loop();
+		sitl::spendCycles(kLoopCycles);
+		// Done once the whole program ran
+		if (Serial.done() && operationsBuffer.empty() && gMotionController.finished())
+			break;
+	}
 	return 0;
 }
 
@@ -17,15 +17,58 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
+#include <staticRingBuffer.h>
+#include <type_traits>
+#include <utility>
+#include "arcGenerator.h"
+#include "axes.h"
 #include "clock.h"
+#include "motionProfile.h"
+#include "motionTables.h"
+#include "planner.h"
+#include "serialPort.h"
 #include "stepperDriver.h"
+#include "stepTimer.h"
 #include "vector.h"
 #include "HardwareConfig.h"
 
 using namespace std::chrono_literals;
 
-// Control motor stepping for all three axes and keep track of their estimated position
-template<class clock_t>
+// Constant rate chunk of a move, ready for the step interrupt.
+// Segments last about one acceleration tick, and are prepared ahead of time by the main loop, so the
+// step interrupt never evaluates velocity profiles.
+struct StepSegment
+{
+	uint16_t events;
+	StepTimer::duration period;
+	bool startsMove; // Load the next StepMove before the first event
+};
+
+namespace mc_impl
+{
+	template<class T, class... Ts>
+	constexpr T maxOf(T first, Ts... rest)
+	{
+		((first = rest > first ? rest : first), ...);
+		return first;
+	}
+
+	// Position of T in Ts
+	template<class T, class... Ts>
+	constexpr int indexOf()
+	{
+		int index = 0;
+		bool found = false;
+		((found = found || std::is_same_v<T, Ts>, index += found ? 0 : 1), ...);
+		return index;
+	}
+}
+
+// Control motor stepping for all the given axes (see axes.h) and keep track of their estimated position.
+// Moves are queued in a look-ahead planner from the main loop, split into segments, and executed
+// one step event at a time from the step timer interrupt.
+// Per axis code is generated from the axis list at compile time, so axes cost nothing unless present.
+template<class clock_t, class... Axes>
 class MotionController
 {
 public:
@@ -33,9 +76,9 @@ public:
 	using duration = typename clock::duration;
 	using time = typename clock::time_point;
 
-	using Vec3step = Vec3<MotorSteps>;
-
-	using XMinEndStop = Pin3::In;
+	static constexpr int kNumAxes = sizeof...(Axes);
+	static_assert(kNumAxes >= 3 && kNumAxes <= 8, "X, Y and Z, and up to 5 more axes");
+	using StepVector = Vector<MotorSteps, kNumAxes>;
 
 	static constexpr int32_t kUnknownPos = int32_t(1ul << 31);
 	static constexpr auto UnkownStep = MotorSteps(kUnknownPos);
@@ -44,190 +87,673 @@ public:
 	void start(); // Engage motors
 	void stop(); // Disengate motors
 
+	static constexpr size_t kSegmentCapacity = 16;
+	static constexpr size_t kMoveCapacity = 8;
+
+	// Split queued moves into segments for the step engine. Must be called often from the main loop.
+	// Returns true when the step engine was idle and must be started to execute new segments.
+	bool update();
+	// Perform one step event. Called from the step timer interrupt, every tickPeriod()
 	void step();
-	bool finished() const { return m_targetPosition == m_curPosition; }
-	const Vec3step& getMotorPositions() const { return m_curPosition; }
+	// Called from the interrupt of the endstop of Axis. If the endstop is being watched, halts the step
+	// engine right away, so the motor positions stay latched at the step where it triggered.
+	template<class Axis>
+	void endstopInterrupt();
+	// With kSplitStepPulses, step() leaves step pins high, and this must be called at least
+	// kStepPulseWidth after it to end the pulses, even after the last event. Direction changes of a
+	// new move happen here too, and update() doesn't start one until the pulses end.
+	void endStepPulses();
+	static constexpr auto kStepPulseWidth = mc_impl::maxOf(Axes::Driver::kMinPulseWidth...);
+	// The step engine has no segment to execute
+	bool idle() const { return m_segmentEvents == 0; }
+	bool finished() const { return stopped() && !homing(); }
+	// No room for more moves
+	bool full() const { return m_planner.full() || m_arc.active() || homing(); }
+	// The homing cycle started by goHome() is running
+	bool homing() const { return m_homingPhase != HomingPhase::idle; }
+	StepTimer::duration tickPeriod() const { return m_tickPeriod; }
+	const StepVector& getMotorPositions() const { return m_curPosition; }
+	// Positions at the end of the last queued move
+	const StepVector& getPlannedPositions() const { return m_plannedPosition; }
+	// Moves waiting in the planner
+	size_t plannedMoves() const { return m_planner.size(); }
 
 	// Motion operations
-	void setLinearTarget(const Vec3step& targetPos);
+	// Moves run at feedRate along the path, clamped to the max speed of every axis.
+	// kRapidFeed runs them as fast as the axes allow.
+	static constexpr auto kRapidFeed = um_second(0);
+	void setLinearTarget(const StepVector& targetPos, um_second feedRate = kRapidFeed);
+	// Arc from the planned position to targetPos around center, in mm on the axes of the plane.
+	// Split into chords of at most kArcTolerance error as the planner makes room for them.
+	void setArcTarget(const StepVector& targetPos, const float center[2], ArcPlane plane, bool clockwise, um_second feedRate = kRapidFeed);
+	// Home the axes with endstops, once queued moves finish (see kHoming* in HardwareConfig.h).
+	// Axes home one at a time, Z first to clear the work. Axes without endstops take their unknown
+	// positions as the origin. All axes end up at the origin.
 	void goHome();
-	// TODO: Arc movements
 
-	void printState() const;
+	// Report target, current and remaining positions of every axis, and the min duration of the last move
+	template<class Output>
+	void printState(Output& out) const;
 
-	template<class Dist>
-	static std::chrono::milliseconds linearArcMinDuration(const Vec3<Dist>& arc);
+	static std::chrono::microseconds linearArcMinDuration(const StepVector& arc);
 
 private:
-	time m_t0; // Motion start time
-	std::chrono::milliseconds m_dt{};
-
-	Vec3step m_curPosition = { UnkownStep, UnkownStep , UnkownStep };
-	Vec3step m_targetPosition = { UnkownStep, UnkownStep , UnkownStep };
-	Vec3step m_srcPosition = { UnkownStep, UnkownStep , UnkownStep };
-	Vec3step m_arc = {};
-
-	template<size_t axis_, typename Motor>
-	void stepAxis(Motor& motor, MotorSteps goal)
+	using Move = StepMove<kNumAxes>;
+	using AxisIndices = std::make_index_sequence<kNumAxes>;
+
+	std::chrono::microseconds m_dt{}; // Minimum duration of the last queued move
+	StepTimer::duration m_tickPeriod{};
+
+	StepVector m_curPosition = StepVector::filled(UnkownStep);
+	StepVector m_plannedPosition = StepVector::filled(UnkownStep);
+
+	Planner<Axes...> m_planner;
+
+	// Arc being split into chords. Main loop only.
+	ArcGenerator m_arc;
+	StepVector m_arcTarget;
+	um_second m_arcFeedRate = kRapidFeed;
+
+	// Move being split into segments. Main loop only.
+	PlannedMove<kNumAxes> m_prepMove;
+	int32_t m_prepEvent = 0; // Events already in segments
+	int32_t m_prepEvents = 0; // Events left to put in segments
+	StepTimer::duration m_sinceRateUpdate{};
+
+	// Work ready for the step engine. Shared with the step interrupt.
+	etl::FixedRingBuffer<StepSegment, kSegmentCapacity> m_segments;
+	uint32_t m_queuedTicks = 0; // Duration of the segments in m_segments
+	etl::FixedRingBuffer<Move, kMoveCapacity> m_moves;
+
+	// Move and segment being executed
+	Move m_move;
+	Vector<int32_t, kNumAxes> m_stepError = {};
+	uint16_t m_segmentEvents = 0;
+	// Direction pins of a move that started during a step pulse. Written once the pulse ends.
+	uint8_t m_nextDir = 0;
+	bool m_dirPending = false;
+	bool m_stepPulse = false; // Step pins are high, waiting for endStepPulses
+
+	// Homing cycle. Main loop only.
+	enum class HomingPhase : uint8_t
 	{
-		if (m_curPosition.element<axis_>() >= 0)
+		idle,
+		start, // Waiting for queued moves to finish
+		seek, // Fast move toward the endstop
+		backOff, // Move away from the endstop by the pull-off distance
+		locate, // Slow move toward the endstop
+		pullOff // Move away from the endstop to the origin
+	};
+	HomingPhase m_homingPhase = HomingPhase::idle;
+	int m_homingStep = 0; // Position of the axis being homed in the homing order
+
+	// Bits of the axes whose endstops halt the step engine, and whether one of them did.
+	// Shared with the endstop interrupts. Outside of homing, the endstops of homed axes act as hard limits.
+	volatile uint8_t m_watchedEndstops = 0;
+	volatile bool m_endstopHit = false;
+
+	static constexpr bool kHasEndstop[kNumAxes] = { Axes::Endstop::kPresent... };
+	static constexpr uint8_t kEndstopAxes = uint8_t((((Axes::Endstop::kPresent ? 1 : 0) << mc_impl::indexOf<Axes, Axes...>()) | ...));
+	static constexpr int homingAxis(int homingStep) { return homingStep == 0 ? 2 : homingStep <= 2 ? homingStep - 1 : homingStep; }
+
+	// Pins of all axes, written together on every step event
+	using StepPins = PortGroup<typename Axes::Driver::StepPin...>;
+	using DirPins = PortGroup<typename Axes::Driver::DirPin...>;
+
+	// Returns the bit of the axis in StepPins if it has to step
+	template<size_t axis_>
+	uint8_t stepAxis()
+	{
+		auto& error = m_stepError.template element<axis_>();
+		error += m_move.stepDelta.template element<axis_>();
+		if (error > 0)
 		{
-			if (goal > m_curPosition.element<axis_>())
-			{
-				motor.step();
-				m_curPosition.element<axis_>()++;
-			}
-			else if (goal < m_curPosition.element<axis_>())
-			{
-				motor.step();
-				m_curPosition.element<axis_>()--;
-			}
+			error -= m_move.events;
+			m_curPosition.template element<axis_>() += m_move.stepIncrement.template element<axis_>();
+			return 1 << axis_;
 		}
+		return 0;
+	}
+
+	// Bits in StepPins of the axes that have to step
+	template<size_t... axes_>
+	uint8_t stepAxes(std::index_sequence<axes_...>)
+	{
+		return (stepAxis<axes_>() | ...);
+	}
+
+	// Bits in DirPins of the axes moving forward
+	template<size_t... axes_>
+	uint8_t forwardAxes(std::index_sequence<axes_...>) const
+	{
+		return ((m_move.stepIncrement[axes_] > 0 ? 1 << axes_ : 0) | ...);
 	}
 
-	XAxisStepper MotorX;
-	YAxisStepper MotorY;
-	ZAxisStepper MotorZ;
+	// Bits of the selected axes whose endstops are triggered
+	template<size_t... axes_>
+	static uint8_t triggeredEndstops(uint8_t selection, std::index_sequence<axes_...>)
+	{
+		return (((selection & (1 << axes_)) && Axes::Endstop::triggered() ? 1 << axes_ : 0) | ...);
+	}
+
+	// Time the slowest axis needs to travel its part of the move
+	template<size_t... axes_>
+	static std::chrono::microseconds axesMinDuration(const StepVector& arc, std::index_sequence<axes_...>)
+	{
+		const auto minTravelDt = mc_impl::maxOf((Axes::kMinStepPeriod * MotorSteps(abs(arc[axes_])))...);
+		return std::chrono::duration_cast<std::chrono::microseconds>(minTravelDt);
+	}
 
-	XMinEndStop EndStopMinX;
+	// Drivers of all axes
+	struct Drivers : Axes::Driver...
+	{
+		void enable() { (Axes::Driver::enable(), ...); }
+		void disable() { (Axes::Driver::disable(), ...); }
+	} m_drivers;
+
+	// No motion queued or executing
+	bool stopped() const { return idle() && m_segments.empty() && m_prepEvents == 0 && m_planner.empty() && !m_arc.active(); }
+
+	void queueLinearMove(const StepVector& targetPos, um_second feedRate);
+	void updateHoming(bool endstopHit);
+	void startHomingAxis();
+	void failHoming();
+	void hardLimit();
+	void seekEndstop(int axis, int32_t steps, um_second feedRate);
+	void queueHomingMove(int axis, int32_t steps, um_second feedRate);
+	void setAxisOrigin(int axis);
+	void discardMoves();
+	void queueArcChords();
+	void prepareSegments();
+	StepSegment nextSegment();
+	void loadNextSegment();
 };
 
-template<class clock_t>
-MotionController<clock_t>::MotionController()
+template<class clock_t, class... Axes>
+MotionController<clock_t, Axes...>::MotionController()
 {
 	// Make sure we start with motors disabled
-	MotorX.disable();
-	MotorY.disable();
-	MotorZ.disable();
+	m_drivers.disable();
+	(Axes::Endstop::init(), ...);
 }
 
-template<class clock_t>
-void MotionController<clock_t>::start()
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::start()
 {
-	// Make sure we start with motors disabled
-	MotorX.enable();
-	MotorY.enable();
-	MotorZ.enable();
+	m_drivers.enable();
 }
 
-template<class clock_t>
-void MotionController<clock_t>::stop()
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::stop()
 {
-	// Make sure we start with motors disabled
-	MotorX.disable();
-	MotorY.disable();
-	MotorZ.disable();
+	m_drivers.disable();
 }
 
-template<class clock_t>
-void MotionController<clock_t>::step()
+template<class clock_t, class... Axes>
+bool MotionController<clock_t, Axes...>::update()
+{
+	const bool endstopHit = m_endstopHit;
+	if (endstopHit)
+		discardMoves();
+	if (homing())
+		updateHoming(endstopHit);
+	else if (endstopHit)
+		hardLimit();
+	queueArcChords();
+	prepareSegments();
+
+	noInterrupts();
+	// The pulse of the last event ends from the step timer first, so it keeps its width and the
+	// directions of the new move don't change during it
+	const bool mustStart = idle() && !m_stepPulse && !m_segments.empty() && !m_endstopHit;
+	if (mustStart)
+	{
+		loadNextSegment();
+		endStepPulses(); // No pulse running, so directions can change right away
+	}
+	interrupts();
+	return mustStart;
+}
+
+// Keep the segment buffer full, so the step interrupt has work while the main loop is busy elsewhere
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::prepareSegments()
+{
+	for (;;)
+	{
+		noInterrupts();
+		const bool segmentsFull = m_segments.full();
+		const bool movesFull = m_moves.full();
+		const bool fromRest = idle() && m_segments.empty();
+		const uint32_t queuedTicks = m_queuedTicks;
+		interrupts();
+		if (segmentsFull)
+			return;
+
+		if (m_prepEvents == 0)
+		{
+			// Freeze the profile of the next move as late as possible, to give the planner more room to
+			// look ahead, but before the step engine runs out of work.
+			constexpr auto kLookAheadTicks = std::chrono::duration_cast<StepTimer::duration>(kSegmentLookAhead).count();
+			if (m_planner.empty() || movesFull || queuedTicks >= kLookAheadTicks)
+				return;
+			m_prepMove = m_planner.pop(fromRest);
+			m_prepEvent = 0;
+			m_prepEvents = m_prepMove.steps.events;
+			m_sinceRateUpdate = {};
+			noInterrupts();
+			m_moves.push_back(m_prepMove.steps);
+			interrupts();
+		}
+
+		const StepSegment segment = nextSegment();
+		const uint32_t ticks = uint32_t(segment.events) * segment.period.count();
+		noInterrupts();
+		m_segments.push_back(segment);
+		m_queuedTicks += ticks;
+		interrupts();
+	}
+}
+
+// Cut the next segment of the move being prepared, and advance its velocity profile past it
+template<class clock_t, class... Axes>
+StepSegment MotionController<clock_t, Axes...>::nextSegment()
+{
+	auto& profile = m_prepMove.profile;
+	const uint32_t rate = profile.rate();
+
+	StepSegment segment;
+	segment.startsMove = m_prepEvent == 0;
+	segment.period = ratePeriod<kMaxStepRate<Axes...>>(rate);
+
+	// One acceleration tick worth of events, but don't overshoot the start of the deceleration ramp
+	int32_t events = max(int32_t(perAccelerationTick(rate)), int32_t(1));
+	events = min(events, m_prepEvents);
+	const int32_t decelerateAfter = profile.decelerateAfter();
+	if (m_prepEvent < decelerateAfter && m_prepEvent + events > decelerateAfter)
+		events = decelerateAfter - m_prepEvent;
+	segment.events = uint16_t(events);
+	m_prepEvent += events;
+	m_prepEvents -= events;
+
+	m_sinceRateUpdate += segment.period * events;
+	if (profile.startsDecelerating(m_prepEvent))
+		m_sinceRateUpdate = kAccelerationTickPeriod;
+	// Slow rates can span several acceleration ticks per segment
+	while (m_sinceRateUpdate >= kAccelerationTickPeriod)
+	{
+		profile.tick(m_prepEvent);
+		m_sinceRateUpdate -= kAccelerationTickPeriod;
+	}
+
+	return segment;
+}
+
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::step()
 {
 	// Am I there yet?
-	if (finished())
+	if (idle())
 		return;
 
-	// Compute instant target
-	auto t = clock::now();
-	auto dt = std::chrono::duration_cast<std::chrono::milliseconds>(t - m_t0);
-	
-	Vec3step dPos = m_arc * dt.count() / m_dt.count();
-	// Clamp target
-	if (abs(dPos.x()) > m_arc.x()) dPos.x() = m_arc.x();
-	if (abs(dPos.y()) > m_arc.y()) dPos.y() = m_arc.y();
-	if (abs(dPos.z()) > m_arc.z()) dPos.z() = m_arc.z();
+	StepPins::setHigh(stepAxes(AxisIndices()));
+	m_stepPulse = true;
+	if (--m_segmentEvents == 0) // Continue with the next segment without stopping
+		loadNextSegment();
 
-	auto instantTarget = m_srcPosition + dPos;
-	// Do I need to move?
-	//tlog.push_back({ dt,instantTarget.x() });
-	if (instantTarget != m_curPosition)
+	if constexpr (!kSplitStepPulses)
 	{
-		// step X
-		stepAxis<0>(MotorX, instantTarget.x());
-		// step Y
-		stepAxis<1>(MotorY, instantTarget.y());
-		// step Z
-		stepAxis<2>(MotorZ, instantTarget.z());
+		delayMicroseconds(kStepPulseWidth.count());
+		endStepPulses();
 	}
 }
 
-template<class clock_t>
-void MotionController<clock_t>::setLinearTarget(const Vec3step& targetPos)
+template<class clock_t, class... Axes>
+template<class Axis>
+void MotionController<clock_t, Axes...>::endstopInterrupt()
 {
-	m_targetPosition.x() = max(targetPos.x(), MotorSteps(0));
-	m_targetPosition.y() = max(targetPos.y(), MotorSteps(0));
-	m_targetPosition.z() = max(targetPos.z(), MotorSteps(0));
-	m_srcPosition = m_curPosition;
-	m_arc = m_targetPosition - m_srcPosition;
+	constexpr uint8_t bit = 1 << mc_impl::indexOf<Axis, Axes...>();
+	if (!(m_watchedEndstops & bit))
+		return;
+	// The main loop discards the rest of the queued moves
+	m_watchedEndstops = 0;
+	m_endstopHit = true;
+	m_segmentEvents = 0;
+}
 
-	MotorX.setDir(m_arc.x() >= MotorSteps(0));
-	MotorY.setDir(m_arc.y() >= MotorSteps(0));
-	MotorZ.setDir(m_arc.z() >= MotorSteps(0));
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::endStepPulses()
+{
+	StepPins::setLow(StepPins::kAll);
+	m_stepPulse = false;
+	if (m_dirPending)
+	{
+		DirPins::write(m_nextDir);
+		m_dirPending = false;
+	}
+}
 
-	m_dt = linearArcMinDuration(m_arc);
+// Called from the step interrupt, or with interrupts disabled
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::loadNextSegment()
+{
+	if (m_segments.empty())
+		return;
+	const StepSegment segment = m_segments.front();
+	m_segments.pop_front();
+	m_queuedTicks -= uint32_t(segment.events) * segment.period.count();
 
-	printState();
+	if (segment.startsMove)
+	{
+		m_move = m_moves.front();
+		m_moves.pop_front();
+		// Direction pins can't change during a step pulse, so they wait for endStepPulses. The first step of
+		// the move comes a whole period later, which leaves the driver the dir to step setup time it needs.
+		m_nextDir = forwardAxes(AxisIndices());
+		m_dirPending = true;
+
+		// Start half way so steps of the shorter axes are centered around their ideal positions
+		for (int i = 0; i < kNumAxes; ++i)
+			m_stepError[i] = -(m_move.events / 2);
+	}
 
-	m_t0 = clock::now();
+	m_segmentEvents = segment.events;
+	m_tickPeriod = segment.period;
 }
 
-template<class clock_t>
-void MotionController<clock_t>::goHome()
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::setLinearTarget(const StepVector& targetPos, um_second feedRate)
 {
+	queueLinearMove(targetPos, feedRate);
+	// Deferred, so the report doesn't hold up the step engine
+	gLog.beginReport();
+	printState(gLog);
+	gLog.endReport();
+}
 
-	m_targetPosition = Vec3i(0, 0, 0);
-	if (m_curPosition.x() == kUnknownPos)
-		m_curPosition.x() = MotorSteps(0);
-	if (m_curPosition.y() == kUnknownPos)
-		m_curPosition.y() = MotorSteps(0);
-	if (m_curPosition.z() == kUnknownPos)
-		m_curPosition.z() = MotorSteps(0);
-	m_srcPosition = m_curPosition;
-	m_arc = m_targetPosition - m_srcPosition;
-	m_dt = linearArcMinDuration(m_arc);
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::setArcTarget(const StepVector& targetPos, const float center[2], ArcPlane plane, bool clockwise, um_second feedRate)
+{
+	const ArcAxes axes = arcAxes(plane);
+	if (m_plannedPosition[axes.first] == kUnknownPos || m_plannedPosition[axes.second] == kUnknownPos)
+	{
+		// Can't draw an arc from an unknown position
+		setLinearTarget(targetPos, feedRate);
+		return;
+	}
 
-	MotorX.setDir(false);
-	MotorY.setDir(false);
-	MotorZ.setDir(false);
+	// Arcs are drawn on X, Y and Z. Any other axes move with the last chord.
+	const float steps_mm[kNumAxes] = { float(Axes::kSteps_mm.count())... };
+	float start[3];
+	float end[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		start[i] = m_plannedPosition[i] == kUnknownPos ? 0.f : m_plannedPosition[i].count() / steps_mm[i];
+		end[i] = targetPos[i].count() / steps_mm[i];
+	}
+	m_arc.start(start, end, center, plane, clockwise, kArcTolerance.count() / 1000.f);
+	m_arcTarget = targetPos;
+	m_arcFeedRate = feedRate;
+	queueArcChords();
+	gLog.beginReport();
+	printState(gLog);
+	gLog.endReport();
 }
 
-namespace mc_impl
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::queueArcChords()
+{
+	const float steps_mm[kNumAxes] = { float(Axes::kSteps_mm.count())... };
+	while (m_arc.active() && !m_planner.full())
+	{
+		float pos[3];
+		m_arc.next(pos);
+		if (!m_arc.active())
+		{
+			queueLinearMove(m_arcTarget, m_arcFeedRate); // Land exactly on the target
+			return;
+		}
+
+		StepVector target = m_plannedPosition;
+		for (int i = 0; i < 3; ++i)
+			target[i] = MotorSteps(int32_t(lroundf(pos[i] * steps_mm[i])));
+		queueLinearMove(target, m_arcFeedRate);
+	}
+}
+
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::queueLinearMove(const StepVector& targetPos, um_second feedRate)
+{
+	StepVector target;
+	for (int i = 0; i < kNumAxes; ++i)
+	{
+		// Axes can't move until their position is known
+		if (m_plannedPosition[i] == kUnknownPos)
+			target[i] = UnkownStep;
+		else
+			target[i] = max(targetPos[i], MotorSteps(0));
+	}
+
+	const StepVector arc = target - m_plannedPosition;
+	m_plannedPosition = target;
+	m_dt = linearArcMinDuration(arc);
+	if (arc != StepVector::filled(MotorSteps(0)))
+		m_planner.push(arc, m_dt, feedRate.count() / 1000.f);
+}
+
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::goHome()
+{
+	m_homingPhase = HomingPhase::start;
+}
+
+// Advance the homing cycle whenever the move of the current phase ends
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::updateHoming(bool endstopHit)
+{
+	if (!endstopHit && !stopped())
+		return;
+
+	const int axis = homingAxis(m_homingStep);
+	const float steps_mm[kNumAxes] = { float(Axes::kSteps_mm.count())... };
+	const int32_t pullOff = int32_t(micrometers(kHomingPullOff).count() * steps_mm[axis] / 1000);
+	switch (m_homingPhase)
+	{
+	case HomingPhase::start:
+		m_homingStep = 0;
+		startHomingAxis();
+		break;
+	case HomingPhase::seek:
+		if (!endstopHit)
+		{
+			failHoming();
+			return;
+		}
+		setAxisOrigin(axis);
+		m_homingPhase = HomingPhase::backOff;
+		queueHomingMove(axis, pullOff, kHomingSeekFeed);
+		break;
+	case HomingPhase::backOff:
+		m_homingPhase = HomingPhase::locate;
+		seekEndstop(axis, -2 * pullOff, kHomingLocateFeed);
+		break;
+	case HomingPhase::locate:
+		if (!endstopHit)
+		{
+			failHoming();
+			return;
+		}
+		setAxisOrigin(axis);
+		m_homingPhase = HomingPhase::pullOff;
+		queueHomingMove(axis, pullOff, kHomingLocateFeed);
+		break;
+	case HomingPhase::pullOff:
+		setAxisOrigin(axis);
+		++m_homingStep;
+		startHomingAxis();
+		break;
+	default:
+		break;
+	}
+}
+
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::startHomingAxis()
+{
+	while (m_homingStep < kNumAxes && !kHasEndstop[homingAxis(m_homingStep)])
+		++m_homingStep;
+
+	if (m_homingStep == kNumAxes)
+	{
+		// Axes with unknown positions don't move, so the step interrupt doesn't touch them
+		noInterrupts();
+		for (int i = 0; i < kNumAxes; ++i)
+		{
+			if (m_plannedPosition[i] == kUnknownPos)
+			{
+				m_plannedPosition[i] = MotorSteps(0);
+				m_curPosition[i] = MotorSteps(0);
+			}
+		}
+		interrupts();
+		m_homingPhase = HomingPhase::idle;
+		m_watchedEndstops = kEndstopAxes;
+		setLinearTarget(StepVector::filled(MotorSteps(0)));
+		return;
+	}
+
+	// Seek from wherever the axis is
+	const int axis = homingAxis(m_homingStep);
+	const float steps_mm[kNumAxes] = { float(Axes::kSteps_mm.count())... };
+	setAxisOrigin(axis);
+	m_homingPhase = HomingPhase::seek;
+	seekEndstop(axis, -int32_t(kHomingMaxTravel.count() * steps_mm[axis]), kHomingSeekFeed);
+}
+
+// An endstop didn't trigger where expected. Axes with endstops can't move until they home again.
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::failHoming()
 {
-	inline void printAxis(MotorSteps target, MotorSteps current, MotorSteps arc)
+	noInterrupts();
+	m_watchedEndstops = 0;
+	for (int i = 0; i < kNumAxes; ++i)
 	{
-		Serial.print("tx:");
-		Serial.print(target.count());
-		Serial.print(",cx:");
-		Serial.print(current.count());
-		Serial.print(",ax:");
-		Serial.println(arc.count());
+		if (kHasEndstop[i])
+		{
+			m_plannedPosition[i] = UnkownStep;
+			m_curPosition[i] = UnkownStep;
+		}
 	}
+	interrupts();
+	m_homingPhase = HomingPhase::idle;
+	gSerial.println("homing failed");
 }
 
-template<class clock_t>
-void MotionController<clock_t>::printState() const
+// An endstop triggered outside of homing. The sudden stop may have cost steps, so axes with endstops
+// can't move until they home again. Motor positions keep the step where the endstop triggered.
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::hardLimit()
 {
-	mc_impl::printAxis(m_targetPosition.x(), m_curPosition.x(), m_arc.x());
-	mc_impl::printAxis(m_targetPosition.y(), m_curPosition.y(), m_arc.y());
-	mc_impl::printAxis(m_targetPosition.z(), m_curPosition.z(), m_arc.z());
+	for (int i = 0; i < kNumAxes; ++i)
+	{
+		if (kHasEndstop[i])
+			m_plannedPosition[i] = UnkownStep;
+	}
+	gSerial.println("limit hit");
+}
 
-	Serial.print("dt:");
-	Serial.println(m_dt.count());
+// Watch the endstop of the axis and move toward it. An endstop that is already triggered won't raise
+// its interrupt, so it counts as hit right away.
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::seekEndstop(int axis, int32_t steps, um_second feedRate)
+{
+	const uint8_t bit = uint8_t(1 << axis);
+	if (triggeredEndstops(bit, AxisIndices()))
+	{
+		m_endstopHit = true;
+		return;
+	}
+	m_watchedEndstops = bit;
+	queueHomingMove(axis, steps, feedRate);
 }
 
-template<class clock_t>
-template<class Dist>
-std::chrono::milliseconds MotionController<clock_t>::linearArcMinDuration(const Vec3<Dist>& arc)
+// Move a single axis, even if its position is unknown and beyond the origin
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::queueHomingMove(int axis, int32_t steps, um_second feedRate)
 {
-	auto stepsX = MotorSteps(abs(arc.x()));
-	auto minTimeX = kMinStepPeriodX * stepsX;
+	StepVector arc = StepVector::filled(MotorSteps(0));
+	arc[axis] = MotorSteps(steps);
+	m_plannedPosition[axis] += arc[axis];
+	m_dt = linearArcMinDuration(arc);
+	m_planner.push(arc, m_dt, feedRate.count() / 1000.f);
+}
 
-	auto stepsY = MotorSteps(abs(arc.y()));
-	auto minTimeY = kMinStepPeriodY * stepsY;
+// Take the current position of a stopped axis as its origin
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::setAxisOrigin(int axis)
+{
+	noInterrupts();
+	m_curPosition[axis] = MotorSteps(0);
+	m_plannedPosition[axis] = MotorSteps(0);
+	interrupts();
+}
 
-	auto stepsZ = MotorSteps((arc.z()));
-	auto minTimeZ = kMinStepPeriodZ * stepsZ;
+// Drop all the work queued after the step engine stopped on an endstop, and plan from where it stopped
+template<class clock_t, class... Axes>
+void MotionController<clock_t, Axes...>::discardMoves()
+{
+	noInterrupts();
+	m_segments.clear();
+	m_queuedTicks = 0;
+	m_moves.clear();
+	m_plannedPosition = m_curPosition;
+	m_endstopHit = false;
+	interrupts();
+	m_prepEvents = 0;
+	m_planner.clear();
+	m_arc = ArcGenerator();
+}
 
-	auto minTravelDt = max(minTimeX, max(minTimeY, minTimeZ));
-	return std::chrono::duration_cast<std::chrono::milliseconds>(minTravelDt);
+namespace mc_impl
+{
+	// The travel left (ax) is only printed when both positions are known, as it would overflow otherwise
+	template<class Output>
+	void printAxis(Output& out, MotorSteps target, MotorSteps current, bool known)
+	{
+		out.print("tx:");
+		out.print(target.count());
+		out.print(",cx:");
+		if (!known)
+		{
+			out.println(current.count());
+			return;
+		}
+		out.print(current.count());
+		out.print(",ax:");
+		out.println((target - current).count());
+	}
+}
+
+template<class clock_t, class... Axes>
+template<class Output>
+void MotionController<clock_t, Axes...>::printState(Output& out) const
+{
+	noInterrupts();
+	const StepVector current = m_curPosition;
+	interrupts();
+	for (int i = 0; i < kNumAxes; ++i)
+	{
+		const bool known = m_plannedPosition[i] != kUnknownPos && current[i] != kUnknownPos;
+		mc_impl::printAxis(out, m_plannedPosition[i], current[i], known);
+	}
+
+	out.print("dt:");
+	out.println(m_dt.count());
+}
+
+template<class clock_t, class... Axes>
+std::chrono::microseconds MotionController<clock_t, Axes...>::linearArcMinDuration(const StepVector& arc)
+{
+	return axesMinDuration(arc, AxisIndices());
 }
 
@@ -0,0 +1,212 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <cstdint>
+#include <math.h>
+#include <type_traits>
+#include "HardwareConfig.h"
+#include "motionTables.h"
+#include "stepTimer.h"
+
+// Accelerate / cruise / decelerate velocity profile of a move.
+// Rates are measured in step events per second, and positions in step events since the start of the move.
+class TrapezoidalProfile
+{
+public:
+	void plan(int32_t events, uint32_t entryRate, uint32_t cruiseRate, uint32_t exitRate, uint32_t acceleration);
+	// Same interface as the S-curve profile. Jerk is unlimited here.
+	void plan(int32_t events, uint32_t entryRate, uint32_t cruiseRate, uint32_t exitRate, uint32_t acceleration, uint32_t /*jerk*/)
+	{
+		plan(events, entryRate, cruiseRate, exitRate, acceleration);
+	}
+
+	uint32_t rate() const { return m_rate; }
+
+	// Advance the profile by one acceleration tick, given the number of events already executed
+	void tick(int32_t event);
+
+	// Deceleration must start right at this event, without waiting for the next acceleration tick
+	bool startsDecelerating(int32_t event) const { return event == m_decelerateAfter; }
+	int32_t decelerateAfter() const { return m_decelerateAfter; }
+
+private:
+	uint32_t m_rate = kMinStepRate;
+	uint32_t m_rateDelta = 0; // Rate increment per acceleration tick
+	uint32_t m_cruiseRate = kMinStepRate;
+	uint32_t m_exitRate = kMinStepRate;
+	int32_t m_accelerateUntil = 0;
+	int32_t m_decelerateAfter = 0;
+};
+
+// Jerk limited velocity profile of a move.
+// Every speed change ramps acceleration up with constant jerk, holds it at the maximum (if there is time to
+// reach it), and ramps it back down to zero, so acceleration is continuous along the whole move.
+// Rates are measured in step events per second, and positions in step events since the start of the move.
+class SCurveProfile
+{
+public:
+	void plan(int32_t events, uint32_t entryRate, uint32_t cruiseRate, uint32_t exitRate, uint32_t acceleration, uint32_t jerk);
+
+	uint32_t rate() const { return m_rate; }
+
+	// Advance the profile by one acceleration tick, given the number of events already executed
+	void tick(int32_t event);
+
+	// Deceleration must start right at this event, without waiting for the next acceleration tick
+	bool startsDecelerating(int32_t event) const { return event == m_decelerateAfter; }
+	int32_t decelerateAfter() const { return m_decelerateAfter; }
+
+	// Events it takes to change rate from v0 to v1
+	static float rampEvents(float v0, float v1, float acceleration, float jerk);
+
+private:
+	uint32_t m_rate = kMinStepRate;
+	uint32_t m_cruiseRate = kMinStepRate;
+	uint32_t m_exitRate = kMinStepRate;
+	uint32_t m_acceleration = 0; // Magnitude of the current acceleration
+	uint32_t m_maxAcceleration = 0;
+	uint32_t m_jerk = 0;
+	uint32_t m_accelerationDelta = 0; // Acceleration increment per acceleration tick
+	int32_t m_decelerateAfter = 0;
+	bool m_decelerating = false;
+};
+
+using MotionProfile = std::conditional_t<kVelocityProfile == VelocityProfile::sCurve, SCurveProfile, TrapezoidalProfile>;
+
+inline void TrapezoidalProfile::plan(int32_t events, uint32_t entryRate, uint32_t cruiseRate, uint32_t exitRate, uint32_t acceleration)
+{
+	m_cruiseRate = cruiseRate;
+	m_rate = min(entryRate, cruiseRate);
+	m_exitRate = min(exitRate, cruiseRate);
+	acceleration = max(acceleration, kAccelerationTicksPerSecond);
+	m_rateDelta = acceleration / kAccelerationTicksPerSecond;
+
+	// Events it takes to change speed: d = (v1^2 - v0^2) / 2a
+	const uint64_t cruise2 = uint64_t(m_cruiseRate) * m_cruiseRate;
+	const uint64_t entry2 = uint64_t(m_rate) * m_rate;
+	const uint64_t exit2 = uint64_t(m_exitRate) * m_exitRate;
+	const int32_t accelEvents = int32_t((cruise2 - entry2) / (2 * acceleration));
+	const int32_t decelEvents = int32_t((cruise2 - exit2) / (2 * acceleration));
+
+	if (accelEvents + decelEvents <= events)
+	{
+		m_accelerateUntil = accelEvents;
+		m_decelerateAfter = events - decelEvents;
+	}
+	else
+	{
+		// The move is too short to reach cruise speed. Accelerate until the two ramps meet
+		const int64_t meetPoint = (2 * int64_t(acceleration) * events + int64_t(exit2) - int64_t(entry2)) / (4 * int64_t(acceleration));
+		m_accelerateUntil = int32_t(max(min(meetPoint, int64_t(events)), int64_t(0)));
+		m_decelerateAfter = m_accelerateUntil;
+	}
+}
+
+inline void TrapezoidalProfile::tick(int32_t event)
+{
+	if (event >= m_decelerateAfter)
+	{
+		m_rate = (m_rate > m_exitRate + m_rateDelta) ? m_rate - m_rateDelta : m_exitRate;
+	}
+	else if (event < m_accelerateUntil || m_rate < m_cruiseRate)
+	{
+		m_rate = min(m_rate + m_rateDelta, m_cruiseRate);
+	}
+}
+
+inline float SCurveProfile::rampEvents(float v0, float v1, float acceleration, float jerk)
+{
+	const float dv = fabsf(v1 - v0);
+	// Ramps that can reach max acceleration hold it for a while. Shorter ones jerk up and straight back down.
+	const float duration = (dv * jerk >= acceleration * acceleration) ? dv / acceleration + acceleration / jerk : 2 * sqrtf(dv / jerk);
+	// Ramps are symmetric, so the average rate is right in the middle
+	return 0.5f * (v0 + v1) * duration;
+}
+
+inline void SCurveProfile::plan(int32_t events, uint32_t entryRate, uint32_t cruiseRate, uint32_t exitRate, uint32_t acceleration, uint32_t jerk)
+{
+	m_rate = min(entryRate, cruiseRate);
+	m_exitRate = min(exitRate, cruiseRate);
+	m_maxAcceleration = max(acceleration, uint32_t(1));
+	m_jerk = max(jerk, kAccelerationTicksPerSecond);
+	m_accelerationDelta = m_jerk / kAccelerationTicksPerSecond;
+	m_acceleration = 0;
+	m_decelerating = false;
+
+	const float a = float(m_maxAcceleration);
+	const float j = float(m_jerk);
+	const float entry = float(m_rate);
+	const float exit = float(m_exitRate);
+	auto fits = [&](float peak) {
+		return rampEvents(entry, peak, a, j) + rampEvents(peak, exit, a, j) <= events;
+	};
+
+	// Lower the cruise rate until both ramps fit in the move
+	float peak = float(cruiseRate);
+	if (!fits(peak))
+	{
+		float low = max(entry, exit);
+		float high = peak;
+		for (int i = 0; i < 12; ++i)
+		{
+			const float mid = 0.5f * (low + high);
+			if (fits(mid))
+				low = mid;
+			else
+				high = mid;
+		}
+		peak = low;
+	}
+	m_cruiseRate = max(uint32_t(peak), max(m_rate, m_exitRate));
+	m_decelerateAfter = max(events - int32_t(rampEvents(float(m_cruiseRate), exit, a, j)), int32_t(0));
+}
+
+inline void SCurveProfile::tick(int32_t event)
+{
+	const bool decelerating = event >= m_decelerateAfter;
+	if (decelerating != m_decelerating)
+	{
+		m_decelerating = decelerating;
+		m_acceleration = 0;
+	}
+
+	const uint32_t target = decelerating ? m_exitRate : m_cruiseRate;
+	const uint32_t remaining = m_rate > target ? m_rate - target : target - m_rate;
+	if (remaining == 0)
+	{
+		m_acceleration = 0;
+		return;
+	}
+
+	// Ramping acceleration from a down to zero, one tick at a time, changes the rate by (a^2 + a*delta)/2j.
+	// Start doing it just in time to land on the target.
+	const uint32_t increased = min(m_acceleration + m_accelerationDelta, m_maxAcceleration);
+	if (uint64_t(increased) * (increased + m_accelerationDelta) > 2 * uint64_t(m_jerk) * remaining)
+		m_acceleration = m_acceleration > 2 * m_accelerationDelta ? m_acceleration - m_accelerationDelta : m_accelerationDelta;
+	else
+		m_acceleration = increased;
+
+	const uint32_t rateDelta = max(perAccelerationTick(m_acceleration), uint32_t(1));
+	if (rateDelta >= remaining)
+		m_rate = target;
+	else if (m_rate < target)
+		m_rate += rateDelta;
+	else
+		m_rate -= rateDelta;
+}
@@ -0,0 +1,93 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <Arduino.h>
+#include <cstdint>
+#include "HardwareConfig.h"
+#include "stepTimer.h"
+
+// Lookup tables for the runtime profile generator, built at compile time from HardwareConfig.h and kept
+// in program memory. The AVR has no hardware divider, and a 32 bit division takes several hundred cycles.
+
+// Rates are updated at a fixed frequency, independent of the step rate
+constexpr uint32_t kAccelerationTicksPerSecond = 250;
+constexpr auto kAccelerationTickPeriod = StepTimer::duration(StepTimer::kFrequency / kAccelerationTicksPerSecond);
+
+// Slowest step rate of a move. Motors can start and stop at this rate without ramps.
+// Must be high enough for a step period to fit in the step timer.
+constexpr uint32_t kMinStepRate = 120; // steps/s
+static_assert(StepTimer::kFrequency / kMinStepRate < StepTimer::kMaxPeriod.count());
+
+// Fastest step event rate of a machine with the given axes (see axes.h). Moves are never shorter than
+// their steps at the fastest axis' min period.
+template<class... Axes>
+constexpr uint32_t kMaxStepRate = []
+{
+	int32_t period = INT32_MAX; // us/step
+	((period = min(period, int32_t(Axes::kMinStepPeriod.count()))), ...);
+	return uint32_t(1'000'000 / period);
+}();
+
+// Amount per acceleration tick of a quantity per second, like the events or the rate change in a tick.
+// Multiply and shift instead of dividing. Rounds down, and is off by at most one below 400000/s.
+constexpr uint32_t perAccelerationTick(uint32_t perSecond)
+{
+	constexpr uint32_t kScale = (1ul << 16) / kAccelerationTicksPerSecond;
+	static_assert(kScale * kAccelerationTicksPerSecond <= (1ul << 16));
+	return uint32_t((uint64_t(perSecond) * kScale) >> 16);
+}
+
+// Step timer period of every step rate from kMinStepRate to maxRate, at regular intervals.
+// Rates in between are interpolated. The error is largest at the slow end, where it stays under 0.1%.
+template<uint32_t maxRate>
+struct RatePeriodTable
+{
+	static constexpr uint8_t kShift = 3; // Rates between entries: 1 << kShift
+	static constexpr uint32_t kSize = ((maxRate - kMinStepRate) >> kShift) + 2;
+
+	uint16_t period[kSize];
+};
+
+template<uint32_t maxRate>
+constexpr RatePeriodTable<maxRate> makeRatePeriodTable()
+{
+	RatePeriodTable<maxRate> table = {};
+	for (uint32_t i = 0; i < RatePeriodTable<maxRate>::kSize; ++i)
+		table.period[i] = uint16_t(StepTimer::kFrequency / (kMinStepRate + (i << RatePeriodTable<maxRate>::kShift)));
+	return table;
+}
+
+template<uint32_t maxRate>
+inline constexpr RatePeriodTable<maxRate> kRatePeriodTable PROGMEM = makeRatePeriodTable<maxRate>();
+
+// Step timer period of a step rate, looked up in the table up to maxRate (usually kMaxStepRate<Axes...>)
+template<uint32_t maxRate>
+inline StepTimer::duration ratePeriod(uint32_t rate)
+{
+	using Table = RatePeriodTable<maxRate>;
+	const uint32_t offset = rate - kMinStepRate;
+	const uint32_t index = offset >> Table::kShift;
+	if (rate < kMinStepRate || index + 1 >= Table::kSize)
+		return StepTimer::duration(StepTimer::kFrequency / max(rate, uint32_t(1))); // Out of the table
+
+	const uint16_t slow = pgm_read_word(&kRatePeriodTable<maxRate>.period[index]);
+	const uint16_t fast = pgm_read_word(&kRatePeriodTable<maxRate>.period[index + 1]);
+	const uint16_t fraction = uint16_t(offset & ((1 << Table::kShift) - 1));
+	return StepTimer::duration(slow - ((uint32_t(slow - fast) * fraction) >> Table::kShift));
+}
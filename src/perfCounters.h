@@ -0,0 +1,140 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <Arduino.h>
+#include <cstdint>
+#include "serialPort.h"
+
+// Histogram of 16 bit values in power of two buckets. Bucket 0 counts zeros, and bucket n counts values
+// in [2^(n-1), 2^n), so adding a value takes a few shifts and increments, even in an interrupt handler.
+class Log2Histogram
+{
+public:
+	static constexpr uint8_t kNumBuckets = 17;
+
+	void add(uint16_t value)
+	{
+		uint8_t bucket = 0;
+		for (uint16_t v = value; v; v >>= 1)
+			++bucket;
+		++m_counts[bucket];
+		if (value < m_min)
+			m_min = value;
+		if (value > m_max)
+			m_max = value;
+	}
+
+	// Prints min:<min>,max:<max>,hist:<count of each bucket, up to the highest one in use>
+	template<class Output>
+	void print(Output& out) const
+	{
+		uint8_t used = kNumBuckets;
+		while (used > 1 && !m_counts[used - 1])
+			--used;
+		const bool empty = !m_max && !m_counts[0];
+		out.print("min:");
+		out.print(empty ? 0 : m_min);
+		out.print(",max:");
+		out.print(m_max);
+		out.print(",hist:");
+		for (uint8_t i = 0; i < used; ++i)
+		{
+			if (i)
+				out.print(',');
+			out.print(m_counts[i]);
+		}
+		out.print("\r\n");
+	}
+
+private:
+	uint32_t m_counts[kNumBuckets] = {};
+	uint16_t m_min = 0xffff;
+	uint16_t m_max = 0;
+};
+
+// Always on performance counters, to see when serial traffic or planning start to hurt motion.
+// Updated with cheap integer math from the main loop and the step interrupt, and dumped and reset
+// by the 'D' debug command, so every dump covers the time since the previous one. Dumps go through
+// gLog as a single report, so they don't hold up the step engine either.
+struct PerfCounters
+{
+	Log2Histogram loopPeriod; // us between passes of the main loop
+	// StepTimer ticks from the compare match to the start of the step interrupt. Written by the interrupt.
+	// Events later than a whole step period wrap around, and show up as early ones.
+	Log2Histogram stepLateness;
+	uint32_t parsedBytes = 0;
+	// High water marks of the operations buffer and the planner queue
+	uint8_t maxOperations = 0;
+	uint8_t maxPlannedMoves = 0;
+	uint32_t lastLoop = 0; // micros() at the start of the last pass of the main loop
+	uint32_t since = 0; // micros() at the last reset
+
+	// Called at the start of every pass of the main loop
+	void loopStarted()
+	{
+		const uint32_t now = micros();
+		const uint32_t period = now - lastLoop;
+		loopPeriod.add(period > 0xffff ? 0xffff : uint16_t(period));
+		lastLoop = now;
+	}
+
+	void queueOccupancy(uint8_t operations, uint8_t plannedMoves)
+	{
+		if (operations > maxOperations)
+			maxOperations = operations;
+		if (plannedMoves > maxPlannedMoves)
+			maxPlannedMoves = plannedMoves;
+	}
+
+	void dump()
+	{
+		noInterrupts();
+		const Log2Histogram lateness = stepLateness;
+		interrupts();
+
+		gLog.beginReport();
+		gLog.print("loop_us ");
+		loopPeriod.print(gLog);
+		gLog.print("step_late ");
+		lateness.print(gLog);
+		// In float, as a 64 bit division costs the atmega far more, and a rate needs no more precision
+		const uint32_t elapsed = micros() - since;
+		gLog.print("parse_Bps:");
+		gLog.println(elapsed ? uint32_t(float(parsedBytes) * 1e6f / float(elapsed)) : 0);
+		gLog.print("queue_max ops:");
+		gLog.print(maxOperations);
+		gLog.print(",moves:");
+		gLog.println(maxPlannedMoves);
+		gLog.print("log_dropped:");
+		gLog.println(gLog.droppedReports());
+		// A dump that didn't fit in the log keeps the counters for the next one
+		if (gLog.endReport())
+			reset();
+	}
+
+	void reset()
+	{
+		noInterrupts();
+		*this = {};
+		interrupts();
+		since = lastLoop = micros();
+	}
+};
+
+inline PerfCounters gPerfCounters;
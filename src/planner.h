@@ -0,0 +1,245 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <math.h>
+#include <staticRingBuffer.h>
+#include "HardwareConfig.h"
+#include "motionProfile.h"
+#include "vector.h"
+
+// Step pattern of a move, as executed by the step engine.
+// DDA interpolation: every step event advances the axis with the longest travel,
+// and the rest of the axes step each time their accumulated travel overflows it.
+template<int numAxes>
+struct StepMove
+{
+	Vector<int32_t, numAxes> stepDelta; // Absolute travel of each axis
+	Vector<MotorSteps, numAxes> stepIncrement; // +1 or -1 steps
+	int32_t events; // Travel of the longest axis
+};
+
+// Move out of the planner, with its velocity profile final
+template<int numAxes>
+struct PlannedMove
+{
+	StepMove<numAxes> steps;
+	MotionProfile profile;
+};
+
+// Look-ahead planner for the given axes (see axes.h).
+// Keeps a queue of linear moves and plans their entry speeds so that the machine doesn't need
+// to stop at every junction, while it can always stop by the end of the last queued move.
+// Speeds are planned in mm/s, in the main loop. Float math never reaches the step interrupt.
+template<class... Axes>
+class Planner
+{
+public:
+	static constexpr int kNumAxes = sizeof...(Axes);
+	static constexpr size_t kCapacity = 16;
+
+	using StepVector = Vector<MotorSteps, kNumAxes>;
+
+	bool empty() const { return m_blocks.empty(); }
+	bool full() const { return m_blocks.full(); }
+	size_t size() const { return m_blocks.size(); }
+
+	// Drop all queued moves. The next one starts from rest.
+	void clear()
+	{
+		m_blocks.clear();
+		m_fixedEntrySpeed2 = 0;
+	}
+
+	// Queue a move with the given travel, that can't take less than minDuration.
+	// feedRate (mm/s) limits the speed along the path further, unless it is zero.
+	void push(const StepVector& travel, std::chrono::microseconds minDuration, float feedRate = 0);
+
+	// Take the oldest move out of the queue, with its speed profile ready for the step engine.
+	// fromRest means the step engine is stopped, so the move can't start at any speed other than zero.
+	PlannedMove<kNumAxes> pop(bool fromRest);
+
+private:
+	struct Block
+	{
+		StepVector travel;
+		float millimeters;
+		float nominalSpeed; // mm/s
+		float acceleration; // mm/s^2
+		float jerk; // mm/s^3
+		float maxEntrySpeed2; // mm^2/s^2, limited by the junction with the previous move
+		float entrySpeed2; // mm^2/s^2
+	};
+
+	void recalculate();
+	float junctionSpeed2(const float unitVector[kNumAxes], float acceleration) const;
+
+	// S-curve ramps take longer than constant acceleration ones to change speed by the same amount.
+	// Plan speeds with a reduced acceleration so that the ramps chosen here still fit in their moves.
+	static constexpr float kPlanningAccelerationScale = kVelocityProfile == VelocityProfile::sCurve ? 0.5f : 1.f;
+
+	etl::FixedRingBuffer<Block, kCapacity> m_blocks;
+	float m_fixedEntrySpeed2 = 0; // Exit speed of the last move handed to the step engine
+	float m_lastUnitVector[kNumAxes] = {};
+	float m_lastNominalSpeed = 0;
+	float m_lastAcceleration = 0;
+};
+
+template<class... Axes>
+void Planner<Axes...>::push(const StepVector& travel, std::chrono::microseconds minDuration, float feedRate)
+{
+	const float axisSteps_mm[kNumAxes] = { float(Axes::kSteps_mm.count())... };
+	const float axisMaxAccel[kNumAxes] = { float(Axes::kMaxAccel.count())... };
+	const float axisMaxJerk[kNumAxes] = { float(Axes::kMaxJerk.count())... };
+
+	Block block;
+	block.travel = travel;
+
+	float travel_mm[kNumAxes];
+	float length2 = 0;
+	for (int i = 0; i < kNumAxes; ++i)
+	{
+		travel_mm[i] = travel[i].count() / axisSteps_mm[i];
+		length2 += travel_mm[i] * travel_mm[i];
+	}
+	block.millimeters = sqrtf(length2);
+	block.nominalSpeed = block.millimeters * 1e6f / max(minDuration.count(), 1l);
+	if (feedRate > 0)
+		block.nominalSpeed = min(block.nominalSpeed, feedRate);
+
+	// Limit acceleration and jerk along the move so no axis exceeds its own limits
+	float unitVector[kNumAxes];
+	block.acceleration = 1e9f;
+	block.jerk = 1e9f;
+	for (int i = 0; i < kNumAxes; ++i)
+	{
+		unitVector[i] = travel_mm[i] / block.millimeters;
+		if (travel[i].count() != 0)
+		{
+			block.acceleration = min(block.acceleration, axisMaxAccel[i] / fabsf(unitVector[i]));
+			block.jerk = min(block.jerk, axisMaxJerk[i] / fabsf(unitVector[i]));
+		}
+	}
+
+	const float nominal2 = block.nominalSpeed * block.nominalSpeed;
+	if (m_blocks.empty())
+	{
+		// The previous move is already executing, and its exit speed is final
+		block.maxEntrySpeed2 = m_fixedEntrySpeed2;
+	}
+	else
+	{
+		// Both moves share the velocity change at the junction
+		const float prevNominal2 = m_lastNominalSpeed * m_lastNominalSpeed;
+		const float junctionAcceleration = min(block.acceleration, m_lastAcceleration);
+		block.maxEntrySpeed2 = min(junctionSpeed2(unitVector, junctionAcceleration), min(nominal2, prevNominal2));
+	}
+	block.entrySpeed2 = block.maxEntrySpeed2;
+
+	for (int i = 0; i < kNumAxes; ++i)
+		m_lastUnitVector[i] = unitVector[i];
+	m_lastNominalSpeed = block.nominalSpeed;
+	m_lastAcceleration = block.acceleration;
+
+	m_blocks.push_back(block);
+	recalculate();
+}
+
+// Junction deviation model: Fit a circle tangent to both moves whose distance to the corner is
+// kJunctionDeviation, and find the speed at which the centripetal acceleration on it is the maximum.
+template<class... Axes>
+float Planner<Axes...>::junctionSpeed2(const float unitVector[kNumAxes], float acceleration) const
+{
+	// Cosine of the angle between the moves. -1 means a straight line, 1 a full reversal
+	float cosTheta = 0;
+	for (int i = 0; i < kNumAxes; ++i)
+		cosTheta -= m_lastUnitVector[i] * unitVector[i];
+
+	if (cosTheta > 0.999f)
+		return 0;
+	if (cosTheta < -0.999f)
+		return 1e12f; // Straight line. Only limited by nominal speeds
+
+	const float sinHalfTheta = sqrtf(0.5f * (1 - cosTheta));
+	const float deviation_mm = kJunctionDeviation.count() / 1000.f;
+	return acceleration * deviation_mm * sinHalfTheta / (1 - sinHalfTheta);
+}
+
+template<class... Axes>
+void Planner<Axes...>::recalculate()
+{
+	const size_t n = m_blocks.size();
+	if (n == 0)
+		return;
+	m_blocks[0].entrySpeed2 = min(m_fixedEntrySpeed2, m_blocks[0].maxEntrySpeed2);
+
+	// Backward pass: Every move must be able to decelerate to the entry speed of the next one.
+	// The last move in the queue must be able to stop.
+	float nextEntry2 = 0;
+	for (size_t i = n; i-- > 1;)
+	{
+		Block& block = m_blocks[i];
+		block.entrySpeed2 = min(block.maxEntrySpeed2, nextEntry2 + 2 * kPlanningAccelerationScale * block.acceleration * block.millimeters);
+		nextEntry2 = block.entrySpeed2;
+	}
+
+	// Forward pass: Moves can't exit faster than they can accelerate to from their entry speed
+	for (size_t i = 0; i + 1 < n; ++i)
+	{
+		const Block& block = m_blocks[i];
+		Block& next = m_blocks[i + 1];
+		next.entrySpeed2 = min(next.entrySpeed2, block.entrySpeed2 + 2 * kPlanningAccelerationScale * block.acceleration * block.millimeters);
+	}
+}
+
+template<class... Axes>
+PlannedMove<Planner<Axes...>::kNumAxes> Planner<Axes...>::pop(bool fromRest)
+{
+	if (fromRest)
+	{
+		m_fixedEntrySpeed2 = 0;
+		recalculate();
+	}
+
+	const Block& block = m_blocks.front();
+	const float exitSpeed2 = m_blocks.size() > 1 ? m_blocks[1].entrySpeed2 : 0;
+
+	PlannedMove<kNumAxes> move;
+	StepMove<kNumAxes>& steps = move.steps;
+	steps.events = 0;
+	for (int i = 0; i < kNumAxes; ++i)
+	{
+		const int32_t travel = block.travel[i].count();
+		steps.stepDelta[i] = abs(travel);
+		steps.stepIncrement[i] = MotorSteps(travel < 0 ? -1 : 1);
+		steps.events = max(steps.events, steps.stepDelta[i]);
+	}
+
+	// Convert speeds along the path into step event rates
+	const float events_mm = steps.events / block.millimeters;
+	const uint32_t entryRate = max(uint32_t(sqrtf(block.entrySpeed2) * events_mm), kMinStepRate);
+	const uint32_t exitRate = max(uint32_t(sqrtf(exitSpeed2) * events_mm), kMinStepRate);
+	const uint32_t cruiseRate = max(uint32_t(block.nominalSpeed * events_mm), uint32_t(1));
+	const uint32_t acceleration = uint32_t(block.acceleration * events_mm);
+	const uint32_t jerk = uint32_t(min(block.jerk * events_mm, 4e9f));
+	move.profile.plan(steps.events, entryRate, cruiseRate, exitRate, acceleration, jerk);
+
+	m_fixedEntrySpeed2 = exitSpeed2;
+	m_blocks.pop_front();
+	return move;
+}
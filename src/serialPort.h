@@ -0,0 +1,283 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <Arduino.h>
+#include <cstdint>
+#include <type_traits>
+
+// Lock free queue of bytes for one producer and one consumer, typically an interrupt handler and the main loop.
+// Head and tail are single bytes that only one side writes, so they are updated atomically on the atmega.
+// They run freely and wrap at 256, so the whole capacity is usable.
+template<uint8_t capacity>
+class ByteQueue
+{
+public:
+	static_assert(capacity > 0 && capacity <= 128 && (capacity & (capacity - 1)) == 0, "Capacity must be a power of two up to 128");
+	static constexpr uint8_t kCapacity = capacity;
+
+	uint8_t size() const { return uint8_t(m_head - m_tail); }
+	bool empty() const { return m_head == m_tail; }
+	bool full() const { return size() == capacity; }
+
+	// Producer side. Returns false if the queue was full.
+	bool push(uint8_t x)
+	{
+		const uint8_t head = m_head;
+		if (uint8_t(head - m_tail) == capacity)
+			return false;
+		m_data[head & (capacity - 1)] = x;
+		m_head = uint8_t(head + 1);
+		return true;
+	}
+
+	// Consumer side. The queue must not be empty.
+	uint8_t peek() const { return m_data[m_tail & (capacity - 1)]; }
+	uint8_t pop()
+	{
+		const uint8_t tail = m_tail;
+		const uint8_t x = m_data[tail & (capacity - 1)];
+		m_tail = uint8_t(tail + 1);
+		return x;
+	}
+
+private:
+	uint8_t m_data[capacity];
+	volatile uint8_t m_head = 0;
+	volatile uint8_t m_tail = 0;
+};
+
+// Text output on top of the write(char) of Derived
+template<class Derived>
+class TextWriter
+{
+public:
+	void print(const char* s)
+	{
+		while (*s)
+			put(*s++);
+	}
+
+	void print(char c) { put(c); }
+
+	template<class Int>
+	std::enable_if_t<std::is_integral_v<Int>> print(Int x)
+	{
+		// Keep 64 bit math away from the atmega unless it's really needed
+		using Unsigned = std::conditional_t<(sizeof(Int) > sizeof(unsigned long)), unsigned long long, unsigned long>;
+		Unsigned magnitude = Unsigned(x);
+		if constexpr (std::is_signed_v<Int>)
+		{
+			if (x < 0)
+			{
+				put('-');
+				magnitude = Unsigned(0) - magnitude;
+			}
+		}
+		char digits[20];
+		uint8_t n = 0;
+		do
+		{
+			digits[n++] = char('0' + magnitude % 10);
+			magnitude /= 10;
+		} while (magnitude);
+		while (n)
+			put(digits[--n]);
+	}
+
+	template<class T>
+	void println(T x)
+	{
+		print(x);
+		print("\r\n");
+	}
+
+private:
+	void put(char c) { static_cast<Derived*>(this)->write(c); }
+};
+
+// Driver for USART0, the port connected to the usb bridge.
+// Received bytes are stored by the RX interrupt (in serialPort.cpp), so no data is lost while the
+// main loop is busy, as long as it reads them before kRxCapacity bytes pile up.
+// Bytes to send are queued, and the data register empty interrupt feeds them to the USART, so
+// printing only waits for the line when more than kTxCapacity bytes are pending.
+class SerialPort : public TextWriter<SerialPort>
+{
+public:
+	static constexpr uint8_t kRxCapacity = 128;
+	static constexpr uint8_t kTxCapacity = 128;
+
+	void begin(uint32_t baudRate)
+	{
+		// Double speed mode halves the baud rate error at common rates
+		UCSR0A = (1 << U2X0);
+		UBRR0 = uint16_t((F_CPU / 4 / baudRate - 1) / 2);
+		UCSR0C = (1 << UCSZ01) | (1 << UCSZ00); // 8N1
+		UCSR0B = (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
+	}
+
+	// Received bytes waiting to be read
+	uint8_t available() const { return m_rx.size(); }
+	// Room left in the RX buffer
+	uint8_t rxFree() const { return kRxCapacity - m_rx.size(); }
+	// Next received byte. Only valid if available() > 0
+	char read() { return char(m_rx.pop()); }
+
+	// Called from the RX interrupt
+	void onByteReceived(uint8_t c)
+	{
+		if (!m_rx.push(c))
+			m_droppedBytes = m_droppedBytes + 1; // Compound assignment to volatile is deprecated in C++20
+	}
+
+	// Bytes lost because the receive buffer was full
+	uint16_t droppedBytes() const
+	{
+		noInterrupts(); // Two byte read, that the RX interrupt could tear
+		const uint16_t dropped = m_droppedBytes;
+		interrupts();
+		return dropped;
+	}
+
+	// Queue c for transmission. Only waits while the TX buffer is full, which must not happen with
+	// interrupts disabled, as the TX interrupt makes room.
+	void write(char c)
+	{
+		while (!m_tx.push(uint8_t(c)))
+			delayMicroseconds(10); // About a byte at the fastest baud rates
+		UCSR0B |= (1 << UDRIE0);
+	}
+
+	// Room left in the TX buffer
+	uint8_t txFree() const { return kTxCapacity - m_tx.size(); }
+
+	// Called from the data register empty interrupt
+	void onTxReady()
+	{
+		if (!m_tx.empty())
+			UDR0 = m_tx.pop();
+		if (m_tx.empty())
+			UCSR0B &= ~(1 << UDRIE0);
+	}
+
+private:
+	ByteQueue<kRxCapacity> m_rx;
+	ByteQueue<kTxCapacity> m_tx;
+	volatile uint16_t m_droppedBytes = 0;
+};
+
+inline SerialPort gSerial;
+
+// Deferred output for diagnostics, like position reports, that must never hold up motion or parsing.
+// Text is queued in reports, of a single line unless beginReport() and endReport() group several, and
+// flush() moves them to the serial port from the main loop, a line at a time, only while the TX buffer
+// has room for the whole line. Reports that don't fit in the queue are dropped whole, so hosts never
+// see part of one.
+class SerialLog : public TextWriter<SerialLog>
+{
+public:
+	static constexpr uint16_t kCapacity = 256; // Whole range of the uint8_t indices, one byte is kept free
+	static constexpr uint8_t kMaxLine = SerialPort::kTxCapacity; // Longer lines could never be sent
+
+	// The lines written until endReport() are kept or dropped together. Returns false if they were dropped.
+	void beginReport() { m_inReport = true; }
+	bool endReport()
+	{
+		m_inReport = false;
+		return closeReport();
+	}
+
+	// Lines end with '\n'
+	void write(char c)
+	{
+		if (!m_overflow)
+			append(c);
+		if (c == '\n')
+		{
+			m_lineOpen = false;
+			if (!m_inReport)
+				closeReport();
+		}
+	}
+
+	void flush()
+	{
+		while (m_tail != m_committed && gSerial.txFree() >= m_data[m_tail])
+		{
+			for (uint8_t n = m_data[m_tail++]; n; --n)
+				gSerial.write(char(m_data[m_tail++]));
+		}
+	}
+
+	// Reports lost because the queue was full, or a line was too long
+	uint16_t droppedReports() const { return m_droppedReports; }
+
+private:
+	bool full() const { return uint8_t(m_head - m_tail) == kCapacity - 1; }
+
+	// Lines are queued with their size in front, filled in when they end
+	void append(char c)
+	{
+		if (!m_lineOpen)
+		{
+			if (full())
+			{
+				m_overflow = true;
+				return;
+			}
+			m_lineStart = m_head++;
+			m_lineOpen = true;
+		}
+		if (full() || uint8_t(m_head - m_lineStart - 1) == kMaxLine)
+		{
+			m_overflow = true;
+			return;
+		}
+		m_data[m_head++] = uint8_t(c);
+		if (c == '\n')
+			m_data[m_lineStart] = uint8_t(m_head - m_lineStart - 1);
+	}
+
+	// Makes the report visible to flush(), or takes it back if any of it was lost
+	bool closeReport()
+	{
+		const bool kept = !m_overflow && !m_lineOpen;
+		if (kept)
+			m_committed = m_head;
+		else
+		{
+			m_head = m_committed;
+			++m_droppedReports;
+		}
+		m_overflow = false;
+		m_lineOpen = false;
+		return kept;
+	}
+
+	uint8_t m_data[kCapacity];
+	uint8_t m_head = 0; // Next byte to write
+	uint8_t m_tail = 0; // Next byte to send
+	uint8_t m_committed = 0; // End of the last complete report. Only flush() sends bytes before it
+	uint8_t m_lineStart = 0; // Size byte of the open line
+	bool m_lineOpen = false;
+	bool m_inReport = false;
+	bool m_overflow = false; // Part of the open report was lost
+	uint16_t m_droppedReports = 0;
+};
+
+inline SerialLog gLog;
@@ -0,0 +1,83 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <Arduino.h>
+#include <chrono>
+#include <cstdint>
+
+// Hardware timer driving step generation.
+// Timer1 runs in CTC mode with a /8 prescaler, so it ticks every half microsecond and fires
+// TIMER1_COMPA_vect at the end of each programmed period. The interrupt handler is expected to
+// program the period of the next event, so step events happen exactly when scheduled, regardless
+// of what the main loop is doing.
+// Compare match B fires TIMER1_COMPB_vect part way through a period, and is used to end step pulses.
+struct StepTimer
+{
+	static constexpr uint32_t kPrescaler = 8;
+	static constexpr uint32_t kFrequency = F_CPU / kPrescaler;
+	using duration = std::chrono::duration<uint32_t, std::ratio<1, kFrequency>>;
+
+	// Longest period the 16 bit counter can represent
+	static constexpr auto kMaxPeriod = duration(0x10000);
+	static constexpr auto kMinPeriod = duration(2);
+
+	// Start firing step events, the first one after the given period
+	static void start(duration period)
+	{
+		noInterrupts();
+		TCCR1A = 0;
+		TCCR1B = (1 << WGM12); // CTC mode, stopped
+		TCNT1 = 0;
+		setPeriod(period);
+		TIFR1 = (1 << OCF1A); // Clear stale matches
+		TIMSK1 |= (1 << OCIE1A);
+		TCCR1B |= (1 << CS11); // Clock/8
+		interrupts();
+	}
+
+	static void stop()
+	{
+		TIMSK1 &= ~((1 << OCIE1A) | (1 << OCIE1B));
+		TCCR1B &= ~((1 << CS10) | (1 << CS11) | (1 << CS12));
+	}
+
+	static bool running() { return TIMSK1 & (1 << OCIE1A); }
+
+	// Program the period until the next event. Meant to be called from the timer interrupt.
+	static void setPeriod(duration period)
+	{
+		if (period > kMaxPeriod) period = kMaxPeriod;
+		if (period < kMinPeriod) period = kMinPeriod;
+		OCR1A = uint16_t(period.count() - 1);
+	}
+
+	// Time since the last step event
+	static duration sinceEvent() { return duration(TCNT1); }
+
+	// Fire TIMER1_COMPB_vect once, the given time after the last step event.
+	// Must be shorter than the current period.
+	static void setPulseEnd(duration sinceEvent)
+	{
+		OCR1B = uint16_t(sinceEvent.count());
+		TIFR1 = (1 << OCF1B);
+		TIMSK1 |= (1 << OCIE1B);
+	}
+
+	static void clearPulseEnd() { TIMSK1 &= ~(1 << OCIE1B); }
+};
@@ -17,37 +17,33 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
-#include <hal/boards/arduinomega2560.h>
 #include <Arduino.h>
+#include <chrono>
+#include "avrPort.h"
 
-template<class StepPin, class DirPin, class EnablePin>
+// Step, dir and enable pins are port pins (see avrPort.h), so the step engine can write those of all axes at once.
+// minPulseWidth_us is the shortest step pulse the driver chip is guaranteed to register
+template<class StepPin_, class DirPin_, class EnablePin_, uint8_t minPulseWidth_us = 2>
 struct StepperDriver
 {
-	void enable() { enablePin.setLow(); }
-	void disable() { enablePin.setHigh(); }
+	using StepPin = StepPin_;
+	using DirPin = DirPin_;
+	using EnablePin = EnablePin_;
+	static constexpr auto kMinPulseWidth = std::chrono::microseconds(minPulseWidth_us);
 
-	void setDir(bool sign)
+	StepperDriver()
 	{
-		if (sign)
-			dirPin.setHigh();
-		else
-			dirPin.setLow();
+		StepPin::setOutput();
+		DirPin::setOutput();
+		EnablePin::setOutput();
 	}
 
-	void step()
-	{
-		stepPin.setHigh();
-		delayMicroseconds(20);
-		stepPin.setLow();
-	}
-
-	typename StepPin::Out stepPin;
-	typename DirPin::Out dirPin;
-	typename EnablePin::Out enablePin;
+	void enable() { EnablePin::setLow(); }
+	void disable() { EnablePin::setHigh(); }
 };
 
-// Ramps 1.4 definitions
-using XAxisStepper = StepperDriver<Pin54, Pin55, Pin38>;
-// using YAxisStepper = StepperDriver<Pin60,Pin61,Pin56>; // Original RAMPS mapping
-using YAxisStepper = StepperDriver<Pin26, Pin28, Pin24>; // Remapping due to a few burnt traces
-using ZAxisStepper = StepperDriver<Pin46, Pin48, Pin62>;
\ No newline at end of file
+// Ramps 1.4 definitions. DRV8825 drivers need 1.9us step pulses
+using XAxisStepper = StepperDriver<MegaPin<54>, MegaPin<55>, MegaPin<38>, 2>;
+// using YAxisStepper = StepperDriver<MegaPin<60>, MegaPin<61>, MegaPin<56>, 2>; // Original RAMPS mapping
+using YAxisStepper = StepperDriver<MegaPin<26>, MegaPin<28>, MegaPin<24>, 2>; // Remapping due to a few burnt traces
+using ZAxisStepper = StepperDriver<MegaPin<46>, MegaPin<48>, MegaPin<62>, 2>;
\ No newline at end of file
@@ -201,6 +201,8 @@ struct UnitRatioTag {
 };
 
 using SpeedUnitTag = UnitRatioTag<DistanceUnitTag, TimeUnitTag>;
+using AccelerationUnitTag = UnitRatioTag<SpeedUnitTag, TimeUnitTag>;
+using JerkUnitTag = UnitRatioTag<AccelerationUnitTag, TimeUnitTag>;
 using InvSpeedTag = UnitRatioTag<TimeUnitTag, DistanceUnitTag>;
 
 template<class UnitT>
@@ -251,6 +253,14 @@ using Revolutions = Unit<RevolutionUnitTag, Rep, Ratio>;
 template<class Rep, class Ratio = std::ratio<1>>
 using Speed = Unit<SpeedUnitTag, Rep, Ratio>;
 
+// Acceleration unit (S.I. units), ratio relative to 1 meter/second^2
+template<class Rep, class Ratio = std::ratio<1>>
+using Acceleration = Unit<AccelerationUnitTag, Rep, Ratio>;
+
+// Jerk unit (S.I. units), ratio relative to 1 meter/second^3
+template<class Rep, class Ratio = std::ratio<1>>
+using Jerk = Unit<JerkUnitTag, Rep, Ratio>;
+
 template<class Rep, class Ratio = std::ratio<1>>
 using RevolutionPeriod = Unit<UnitRatioTag<TimeUnitTag, RevolutionUnitTag>, Rep, Ratio>;
 
@@ -262,8 +272,12 @@ using meters = Distance<long>;
 
 using meters_second = Speed<long, std::ratio<1>>;
 using mm_second = Speed<long, std::milli>;
+using um_second = Speed<long, std::micro>;
 using mm_millisecond = meters_second;
 
+using mm_second2 = Acceleration<long, std::milli>;
+using mm_second3 = Jerk<long, std::milli>;
+
 constexpr auto operator""_um(unsigned long long s) {
 	return micrometers(s);
 }
@@ -72,6 +72,15 @@ struct Vector
 
 	T norm() const { return sqrt(squareNorm()); }
 
+	// Vector with all elements set to value
+	static Vector filled(T value)
+	{
+		Vector v;
+		for (int i = 0; i < N; ++i)
+			v.m[i] = value;
+		return v;
+	}
+
 private:
 	T m[N];
 };
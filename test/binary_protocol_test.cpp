@@ -0,0 +1,189 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include <cassert>
+#include <cstdint>
+#include "../src/binaryProtocol.h"
+
+using namespace binaryProtocol;
+using Result = Decoder::Result;
+
+GCodeOperation makeMove(int32_t x, int32_t y)
+{
+	GCodeOperation op;
+	op.address = 'G';
+	op.opCode = 1;
+	op.argument[0] = x;
+	op.argument[1] = y;
+	return op;
+}
+
+Result feed(Decoder& decoder, const uint8_t* frame, size_t size)
+{
+	Result result = Result::pending;
+	for (size_t i = 0; i < size; ++i)
+	{
+		assert(result == Result::pending);
+		result = decoder.push(frame[i]);
+	}
+	return result;
+}
+
+void testRoundTrip()
+{
+	Decoder decoder;
+	uint8_t frame[kMaxFrameSize];
+	const GCodeOperation move = makeMove(80'000, -123'456);
+	const size_t size = encode(move, 0, frame);
+	assert(feed(decoder, frame, size) == Result::operation);
+
+	const GCodeOperation& op = decoder.op();
+	assert(op.address == 'G');
+	assert(op.opCode == 1);
+	assert(op.argument[0] == 80'000);
+	assert(op.argument[1] == -123'456);
+	assert(op.argument[2] == GCodeOperation::kEmptyArg);
+	assert(op.argument[3] == GCodeOperation::kEmptyArg);
+
+	// M codes and extreme values
+	GCodeOperation mCode;
+	mCode.address = 'M';
+	mCode.opCode = 3;
+	mCode.argument[3] = INT32_MAX;
+	mCode.argument[2] = GCodeOperation::kEmptyArg + 1;
+	assert(feed(decoder, frame, encode(mCode, 1, frame)) == Result::operation);
+	assert(decoder.op().address == 'M');
+	assert(decoder.op().opCode == 3);
+	assert(decoder.op().argument[3] == INT32_MAX);
+	assert(decoder.op().argument[2] == GCodeOperation::kEmptyArg + 1);
+
+	assert(feed(decoder, frame, encode(GCodeOperation{}, 2, frame)) == Result::endOfProgram);
+}
+
+void testArcFrames()
+{
+	Decoder decoder;
+	uint8_t frame[kMaxFrameSize];
+	GCodeOperation arc = makeMove(10'000, 0);
+	arc.opCode = 2;
+	arc.argument[4] = -5'000; // I
+	arc.argument[7] = 7'500; // R
+	const size_t size = encode(arc, 0, frame);
+	assert(size == 4 + 3 + 1 + 2 + 2 + 2); // Sync, code, header, extended mask, X, Y, I, R, crc
+	assert(feed(decoder, frame, size) == Result::operation);
+	for (int i = 0; i < GCodeOperation::kNumArgs; ++i)
+		assert(decoder.op().argument[i] == arc.argument[i]);
+
+	// Only arcs carry arc arguments
+	GCodeOperation line = arc;
+	line.opCode = 1;
+	assert(feed(decoder, frame, encode(line, 1, frame)) == Result::operation);
+	assert(decoder.op().argument[0] == 10'000);
+	assert(decoder.op().argument[4] == GCodeOperation::kEmptyArg);
+	assert(decoder.op().argument[7] == GCodeOperation::kEmptyArg);
+}
+
+void testCompactFrames()
+{
+	uint8_t frame[kMaxFrameSize];
+	// Text takes 12 bytes: "G01 X80 Y80\n"
+	assert(encode(makeMove(80'000, 80'000), 0, frame) == 11);
+}
+
+void testErrors()
+{
+	Decoder decoder;
+	uint8_t frame[kMaxFrameSize];
+	size_t size = encode(makeMove(1000, 2000), 0, frame);
+
+	// Corrupt frames are rejected, and the decoder resyncs on the next one
+	frame[4] ^= 0x10;
+	assert(feed(decoder, frame, size) == Result::error);
+	assert(decoder.expectedSequence() == 0);
+	size = encode(makeMove(1000, 2000), 0, frame);
+	assert(feed(decoder, frame, size) == Result::operation);
+
+	// Retransmission of an acknowledged frame
+	assert(feed(decoder, frame, size) == Result::duplicate);
+
+	// Lost frame
+	size = encode(makeMove(1000, 2000), 2, frame);
+	assert(feed(decoder, frame, size) == Result::error);
+	assert(decoder.expectedSequence() == 1);
+
+	// Noise between frames is skipped
+	const uint8_t noise[] = { 'G', '1', 0, 0xff };
+	assert(feed(decoder, noise, sizeof(noise)) == Result::pending);
+	size = encode(makeMove(1000, 2000), 1, frame);
+	assert(feed(decoder, frame, size) == Result::operation);
+}
+
+// Writes the crc of frame[1, size) at its end, so only the tested field is invalid. Returns the frame size.
+size_t sealFrame(uint8_t* frame, size_t size)
+{
+	uint16_t crc = kCrcInit;
+	for (size_t i = 1; i < size; ++i)
+		crc = crc16Update(crc, frame[i]);
+	frame[size++] = uint8_t(crc);
+	frame[size++] = uint8_t(crc >> 8);
+	return size;
+}
+
+// Invalid fields are rejected as soon as they arrive, without waiting for the end of the frame
+Result firstResult(Decoder& decoder, const uint8_t* frame, size_t size)
+{
+	Result result = Result::pending;
+	for (size_t i = 0; i < size && result == Result::pending; ++i)
+		result = decoder.push(frame[i]);
+	return result;
+}
+
+void testInvalidFields()
+{
+	Decoder decoder;
+
+	// Codes past the M range, other than kEndOfProgram
+	for (int code = 2 * GCodeOperation::CodeOffsetM; code < kEndOfProgram; ++code)
+	{
+		uint8_t frame[] = { kSync, uint8_t(code), 0, 0, 0 };
+		assert(firstResult(decoder, frame, sealFrame(frame, 3)) == Result::error);
+		assert(decoder.expectedSequence() == 0);
+	}
+
+	// A fifth varint group can only carry the top 4 bits of a 32 bit value
+	uint8_t frame[kMaxFrameSize] = { kSync, 1, 0x01, 0xfe, 0xff, 0xff, 0xff, 0x0f };
+	assert(feed(decoder, frame, sealFrame(frame, 8)) == Result::operation);
+	assert(decoder.op().argument[0] == INT32_MAX);
+	frame[2] = 0x11;
+	frame[7] = 0x10;
+	assert(firstResult(decoder, frame, sealFrame(frame, 8)) == Result::error);
+	assert(decoder.expectedSequence() == 1);
+
+	// kEmptyArg marks missing arguments, so it can't be sent as a value
+	frame[3] = 0xff;
+	frame[7] = 0x0f;
+	assert(firstResult(decoder, frame, sealFrame(frame, 8)) == Result::error);
+}
+
+int main()
+{
+	testRoundTrip();
+	testArcFrames();
+	testCompactFrames();
+	testErrors();
+	testInvalidFields();
+}
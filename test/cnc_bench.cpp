@@ -0,0 +1,328 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Micro-benchmarks of the hot paths of the firmware, run on the host against the SITL emulation.
+// Every benchmark runs batches of operations until a sample of kSampleTime is complete, and reports
+// the time per operation over kSamples samples, after kWarmupTime of discarded runs.
+// Absolute figures are for the host, and include the cost of the emulated peripherals. Compare them
+// against runs of the same build on the same machine.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../src/binaryProtocol.h"
+#include "../src/gCodeTokenizer.h"
+#include "../src/motionController.h"
+#include "simulatedMachine.h"
+
+using namespace std::chrono_literals;
+
+using BenchController = MotionController<MockClock, XAxis, YAxis, ZAxis>;
+using StepVector = BenchController::StepVector;
+using host_clock = std::chrono::steady_clock;
+
+constexpr auto kWarmupTime = 100ms;
+constexpr auto kSampleTime = 2ms;
+constexpr int kSamples = 50;
+
+// Results are written here, so the compiler can't drop the work that produced them
+volatile int64_t gSink;
+
+// Accumulates the time of the timed parts of a batch
+class Stopwatch
+{
+public:
+	void start() { m_start = host_clock::now(); }
+	void stop() { m_elapsed += host_clock::now() - m_start; }
+	std::chrono::nanoseconds elapsed() const { return m_elapsed; }
+
+private:
+	host_clock::time_point m_start;
+	std::chrono::nanoseconds m_elapsed{};
+};
+
+// Time per operation of a sample, in ns
+template<class Batch>
+double runSample(Batch& batch)
+{
+	Stopwatch stopwatch;
+	uint64_t ops = 0;
+	while (stopwatch.elapsed() < kSampleTime)
+		ops += batch(stopwatch);
+	return double(stopwatch.elapsed().count()) / double(ops);
+}
+
+// Benchmark the operations in batch, which runs a batch of them, times it with the stopwatch it takes
+// and returns how many it ran. Setup that doesn't count can run outside of the timed part.
+template<class Batch>
+void bench(const char* name, Batch batch)
+{
+	const auto warmupEnd = host_clock::now() + kWarmupTime;
+	while (host_clock::now() < warmupEnd)
+		runSample(batch);
+
+	std::vector<double> samples;
+	for (int i = 0; i < kSamples; ++i)
+		samples.push_back(runSample(batch));
+	std::sort(samples.begin(), samples.end());
+
+	double mean = 0;
+	for (double sample : samples)
+		mean += sample;
+	mean /= samples.size();
+	double variance = 0;
+	for (double sample : samples)
+		variance += (sample - mean) * (sample - mean);
+	const double stddev = sqrt(variance / (samples.size() - 1));
+	const double median = samples[samples.size() / 2];
+
+	printf("%-36s %10.1f %10.1f %10.1f %8.1f %14.0f\n", name, samples.front(), median, mean, stddev, 1e9 / median);
+}
+
+// Run the main loop and the step interrupt until all queued moves are done
+void runMotion(BenchController& mc)
+{
+	mc.update();
+	while (!mc.finished())
+	{
+		const uint64_t cycles = uint64_t(mc.tickPeriod().count()) * StepTimer::kPrescaler;
+		noInterrupts();
+		mc.step();
+		mc.endStepPulses();
+		interrupts();
+		sitl::spendCycles(cycles);
+		mc.update();
+	}
+}
+
+// Endstop interrupts, wired as in main.cpp, so controllers can home against the simulated axes
+BenchController* gController;
+ISR(INT5_vect) { gController->endstopInterrupt<XAxis>(); }
+ISR(PCINT1_vect) { gController->endstopInterrupt<YAxis>(); }
+ISR(INT3_vect) { gController->endstopInterrupt<ZAxis>(); }
+
+void startAtHome(BenchController& mc)
+{
+	gController = &mc;
+	mc.start();
+	mc.goHome();
+	runMotion(mc);
+}
+
+// Step events of a long diagonal move, back and forth. The main loop work that feeds the segment buffer
+// runs between batches, untimed.
+void benchStep()
+{
+	BenchController mc;
+	startAtHome(mc);
+	bool away = true;
+	bench("MotionController::step", [&](Stopwatch& stopwatch) {
+		if (mc.finished())
+		{
+			mc.setLinearTarget(away ? StepVector(40'000, 30'000, 2'000) : StepVector(0, 0, 0));
+			away = !away;
+		}
+		mc.update();
+		uint64_t events = 0;
+		noInterrupts();
+		stopwatch.start();
+		while (!mc.idle())
+		{
+			mc.step();
+			mc.endStepPulses();
+			++events;
+		}
+		stopwatch.stop();
+		interrupts();
+		return events;
+	});
+}
+
+// Short moves in changing directions, until the planner is full. Includes the position report that
+// every move logs. Moves are short so that running them between batches doesn't take long.
+void benchSetLinearTarget()
+{
+	BenchController mc;
+	startAtHome(mc);
+	const StepVector targets[] = { { 40, 30, 2 }, { 80, 10, 0 }, { 30, 90, 4 }, { 0, 0, 1 } };
+	bench("MotionController::setLinearTarget", [&](Stopwatch& stopwatch) {
+		uint64_t moves = 0;
+		stopwatch.start();
+		while (!mc.full())
+			mc.setLinearTarget(targets[moves++ % 4]);
+		stopwatch.stop();
+		runMotion(mc);
+		return moves;
+	});
+}
+
+void benchLinearArcMinDuration()
+{
+	const StepVector arcs[] = { { 400, -300, 20 }, { -8000, 100, 0 }, { 3, 90'000, -40 }, { 0, 0, 10 } };
+	bench("MotionController::linearArcMinDuration", [&](Stopwatch& stopwatch) {
+		constexpr int kBatch = 1000;
+		int64_t total = 0;
+		stopwatch.start();
+		for (int i = 0; i < kBatch; ++i)
+			total += BenchController::linearArcMinDuration(arcs[i % 4]).count();
+		stopwatch.stop();
+		gSink = total;
+		return kBatch;
+	});
+}
+
+// Decoding of binary G-code frames (see binaryProtocol.h), the parsing path for high throughput hosts.
+void benchFrameDecoding()
+{
+	using namespace binaryProtocol;
+	std::vector<uint8_t> stream;
+	constexpr int kFrames = 64;
+	for (int i = 0; i < kFrames; ++i)
+	{
+		GCodeOperation op;
+		op.address = 'G';
+		op.opCode = 1;
+		op.argument[0] = 1000 * i;
+		op.argument[1] = -537 * i;
+		op.argument[3] = 1'200'000;
+		uint8_t frame[kMaxFrameSize];
+		const size_t size = encode(op, uint8_t(i), frame);
+		stream.insert(stream.end(), frame, frame + size);
+	}
+
+	bench("binaryProtocol::Decoder::push (frame)", [&](Stopwatch& stopwatch) {
+		Decoder decoder;
+		int64_t total = 0;
+		stopwatch.start();
+		for (uint8_t byte : stream)
+		{
+			if (decoder.push(byte) == Decoder::Result::operation)
+				total += decoder.op().argument[0];
+		}
+		stopwatch.stop();
+		gSink = total;
+		return kFrames;
+	});
+}
+
+// Tokenizing of typical text G-code moves, byte by byte as they arrive, per byte and per line
+void benchTextTokenizing()
+{
+	std::string stream;
+	constexpr int kLines = 64;
+	for (int i = 0; i < kLines; ++i)
+	{
+		char line[64];
+		snprintf(line, sizeof(line), "G1 X%d.%03d Y-%d.%02d F%d\r\n", i * 3, (i * 137) % 1000, i, (i * 29) % 100, 600 + 100 * (i % 8));
+		stream += line;
+	}
+
+	auto tokenize = [&](Stopwatch& stopwatch) {
+		GCodeTokenizer tokenizer;
+		int64_t total = 0;
+		stopwatch.start();
+		for (char c : stream)
+		{
+			if (tokenizer.push(c) == GCodeTokenizer::Result::operation)
+				total += tokenizer.op().argument[0];
+		}
+		stopwatch.stop();
+		gSink = total;
+	};
+	bench("GCodeTokenizer::push (byte)", [&](Stopwatch& stopwatch) {
+		tokenize(stopwatch);
+		return stream.size();
+	});
+	bench("GCodeTokenizer::push (line)", [&](Stopwatch& stopwatch) {
+		tokenize(stopwatch);
+		return kLines;
+	});
+}
+
+// Step vector arithmetic as done for every queued move
+void benchVectorArithmetic()
+{
+	const StepVector targets[] = { { 400, -300, 20 }, { -8000, 100, 0 }, { 3, 90'000, -40 }, { 0, 0, 10 } };
+	bench("Vector<MotorSteps, 3> a - b, !=", [&](Stopwatch& stopwatch) {
+		constexpr int kBatch = 1000;
+		StepVector position(0, 0, 0);
+		int64_t moves = 0;
+		stopwatch.start();
+		for (int i = 0; i < kBatch; ++i)
+		{
+			const StepVector arc = targets[i % 4] - position;
+			moves += arc != StepVector::filled(MotorSteps(0));
+			position = targets[i % 4];
+		}
+		stopwatch.stop();
+		gSink = moves + position.x().count();
+		return kBatch;
+	});
+}
+
+// Travel time of a number of steps at the max step rate, as units.h computes it
+void benchUnits()
+{
+	constexpr int kBatch = 1000;
+	std::vector<int32_t> steps;
+	for (int i = 0; i < kBatch; ++i)
+		steps.push_back(i * 37);
+	bench("units: steps * us_step -> us", [&](Stopwatch& stopwatch) {
+		int64_t total = 0;
+		stopwatch.start();
+		for (int32_t n : steps)
+		{
+			const auto travelTime = XAxis::kMinStepPeriod * MotorSteps(n);
+			total += std::chrono::duration_cast<std::chrono::microseconds>(travelTime).count();
+		}
+		stopwatch.stop();
+		gSink = total;
+		return kBatch;
+	});
+}
+
+// Discards the serial output of the firmware
+struct NullBuffer : std::streambuf
+{
+	int overflow(int c) override { return c; }
+};
+
+int main()
+{
+	sitl::simulateAxis<XAxis>(0);
+	sitl::simulateAxis<YAxis>(0);
+	sitl::simulateAxis<ZAxis>(0);
+
+	printf("%-36s %10s %10s %10s %8s %14s\n", "ns/op", "min", "median", "mean", "stddev", "ops/s");
+	fflush(stdout);
+	NullBuffer nullBuffer;
+	std::streambuf* const console = std::cout.rdbuf(&nullBuffer);
+
+	benchStep();
+	benchSetLinearTarget();
+	benchLinearArcMinDuration();
+	benchFrameDecoding();
+	benchTextTokenizing();
+	benchVectorArithmetic();
+	benchUnits();
+
+	std::cout.rdbuf(console);
+}
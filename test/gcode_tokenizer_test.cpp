@@ -0,0 +1,242 @@
+//-------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include "../src/gCodeTokenizer.h"
+
+using Result = GCodeTokenizer::Result;
+
+// Feeds a whole line, which must only produce a result at its end
+Result feed(GCodeTokenizer& tokenizer, const char* line)
+{
+	Result result = Result::pending;
+	for (const char* c = line; *c; ++c)
+	{
+		assert(result == Result::pending);
+		result = tokenizer.push(*c);
+	}
+	return result;
+}
+
+// Value of the X argument in a line of the form "G1 X<value>\n"
+int32_t parseX(const char* value)
+{
+	GCodeTokenizer tokenizer;
+	assert(feed(tokenizer, "G1 X") == Result::pending);
+	assert(feed(tokenizer, value) == Result::pending);
+	assert(tokenizer.push('\n') == Result::operation);
+	return tokenizer.op().argument[0];
+}
+
+bool rejectsX(const char* value)
+{
+	GCodeTokenizer tokenizer;
+	feed(tokenizer, "G1 X");
+	feed(tokenizer, value);
+	return tokenizer.push('\n') == Result::error;
+}
+
+void testArguments()
+{
+	GCodeTokenizer tokenizer;
+	assert(feed(tokenizer, "G1 X80 Y-1.5 F600\n") == Result::operation);
+	const GCodeOperation& op = tokenizer.op();
+	assert(op.address == 'G');
+	assert(op.opCode == 1);
+	assert(op.argument[0] == 80'000);
+	assert(op.argument[1] == -1'500);
+	assert(op.argument[2] == GCodeOperation::kEmptyArg);
+	assert(op.argument[3] == 600'000);
+
+	assert(parseX("0") == 0);
+	assert(parseX(".5") == 500);
+	assert(parseX("-.5") == -500);
+	assert(parseX("12.") == 12'000);
+}
+
+void testDecimals()
+{
+	// Rounded to the closest micrometer, away from zero on ties
+	assert(parseX("1.9995") == 2'000);
+	assert(parseX("1.9994") == 1'999);
+	assert(parseX("-0.0005") == -1);
+	assert(parseX("-0.0004") == 0);
+	// Digits past the rounding one are ignored
+	assert(parseX("0.00049999") == 0);
+	assert(parseX("0.12345678") == 123);
+}
+
+void testRange()
+{
+	// Largest magnitude that fits. Negative values stop short of kEmptyArg.
+	assert(parseX("2147483.647") == 2'147'483'647);
+	assert(parseX("-2147483.647") == -2'147'483'647);
+	assert(rejectsX("2147483.648"));
+	assert(rejectsX("-2147483.648"));
+	assert(rejectsX("2147483.6475"));
+	assert(rejectsX("12345678"));
+	assert(rejectsX("99999999999"));
+}
+
+void testMalformedArguments()
+{
+	// Arguments need digits
+	assert(rejectsX("-"));
+	assert(rejectsX("."));
+	assert(rejectsX("-."));
+	assert(rejectsX(""));
+	assert(rejectsX(" Y1"));
+	assert(rejectsX("1..2"));
+	assert(rejectsX("1A"));
+
+	// The line after an error parses normally
+	GCodeTokenizer tokenizer;
+	assert(feed(tokenizer, "G1 X- Y2\n") == Result::error);
+	assert(feed(tokenizer, "G1 Y2\n") == Result::operation);
+	assert(tokenizer.op().argument[0] == GCodeOperation::kEmptyArg);
+	assert(tokenizer.op().argument[1] == 2'000);
+}
+
+void testCodes()
+{
+	GCodeTokenizer tokenizer;
+	assert(feed(tokenizer, "G01\n") == Result::operation);
+	assert(tokenizer.op().address == 'G');
+	assert(tokenizer.op().opCode == 1);
+	assert(feed(tokenizer, "M3\n") == Result::operation);
+	assert(tokenizer.op().address == 'M');
+	assert(tokenizer.op().opCode == 3);
+	assert(feed(tokenizer, "G1X1Y2\n") == Result::operation); // No spaces needed
+	assert(tokenizer.op().argument[1] == 2'000);
+
+	// Codes need digits, and go up to 99
+	assert(feed(tokenizer, "G X10\n") == Result::error);
+	assert(feed(tokenizer, "G\n") == Result::error);
+	assert(feed(tokenizer, "M;\n") == Result::error);
+	assert(feed(tokenizer, "G99\n") == Result::operation);
+	assert(feed(tokenizer, "G100\n") == Result::error);
+	assert(feed(tokenizer, "G257 X1\n") == Result::error);
+	assert(feed(tokenizer, "Q1\n") == Result::error);
+}
+
+void testSigns()
+{
+	assert(parseX("-1") == -1'000);
+	assert(parseX("-0") == 0);
+	// Signs only go before the first digit
+	assert(rejectsX("1-2"));
+	assert(rejectsX("--1"));
+	assert(rejectsX("1.-2"));
+	assert(rejectsX("1.5-"));
+}
+
+void testComments()
+{
+	GCodeTokenizer tokenizer;
+	assert(feed(tokenizer, "G1 X1; Y2\n") == Result::operation);
+	assert(tokenizer.op().argument[0] == 1'000);
+	assert(tokenizer.op().argument[1] == GCodeOperation::kEmptyArg);
+	assert(feed(tokenizer, "G0 X1 ;G1 X5\n") == Result::operation);
+	assert(tokenizer.op().opCode == 0);
+	assert(tokenizer.op().argument[0] == 1'000);
+
+	// Comment and empty lines are acknowledged without an operation
+	assert(feed(tokenizer, "; Go to reference point\n") == Result::operation);
+	assert(tokenizer.op().address == 0);
+	assert(feed(tokenizer, "\n") == Result::operation);
+	assert(tokenizer.op().address == 0);
+	assert(feed(tokenizer, "   \n") == Result::operation);
+	assert(tokenizer.op().address == 0);
+
+	// Errors inside comments are ignored, and comments don't hide earlier ones
+	assert(feed(tokenizer, "G1 X1 ; X-- Q\n") == Result::operation);
+	assert(feed(tokenizer, "G1 X- ;\n") == Result::error);
+}
+
+void testLineEndings()
+{
+	GCodeTokenizer tokenizer;
+	assert(feed(tokenizer, "G1 X1.5\r\n") == Result::operation);
+	assert(tokenizer.op().argument[0] == 1'500);
+	assert(feed(tokenizer, "\r\n") == Result::operation);
+	assert(tokenizer.op().address == 0);
+	// Anything after a carriage return is ignored, like a comment
+	assert(feed(tokenizer, "G1 X1\r Y2\n") == Result::operation);
+	assert(tokenizer.op().argument[1] == GCodeOperation::kEmptyArg);
+	assert(feed(tokenizer, "G\r\n") == Result::error);
+
+	// Closing '%'
+	assert(feed(tokenizer, "%\r\n") == Result::endOfProgram);
+	tokenizer.reset();
+	assert(feed(tokenizer, "G1 X2\n") == Result::operation);
+	assert(tokenizer.op().argument[0] == 2'000);
+}
+
+// Checks the operations of the program in testSplitLines as they come out
+void checkLine(size_t line, Result result, const GCodeOperation& op)
+{
+	const Result expected[] = { Result::operation, Result::operation, Result::operation, Result::error, Result::operation };
+	assert(line < 5);
+	assert(result == expected[line]);
+	if (line == 0)
+		assert(op.opCode == 1 && op.argument[0] == 12'500 && op.argument[1] == -3'000);
+	else if (line == 2)
+		assert(op.opCode == 0 && op.argument[2] == 1'000 && op.argument[3] == 600'000);
+	else if (line == 4)
+		assert(op.opCode == 2 && op.argument[0] == 1'000 && op.argument[4] == -500);
+}
+
+// Input is parsed in batches, that can end anywhere in a line. Everything needed to resume is in the
+// tokenizer, so the second batch goes to a copy of it.
+void testSplitLines()
+{
+	const char program[] = "G1 X12.5 Y-3\r\n; comment\nG0 Z1 F600\nG X1\nG2 X1 I-0.5\n";
+	const size_t size = sizeof(program) - 1;
+	for (size_t split = 0; split <= size; ++split)
+	{
+		GCodeTokenizer first;
+		size_t line = 0;
+		for (size_t i = 0; i < split; ++i)
+		{
+			const Result result = first.push(program[i]);
+			if (result != Result::pending)
+				checkLine(line++, result, first.op());
+		}
+		GCodeTokenizer second = first;
+		for (size_t i = split; i < size; ++i)
+		{
+			const Result result = second.push(program[i]);
+			if (result != Result::pending)
+				checkLine(line++, result, second.op());
+		}
+		assert(line == 5);
+	}
+}
+
+int main()
+{
+	testArguments();
+	testDecimals();
+	testRange();
+	testMalformedArguments();
+	testCodes();
+	testSigns();
+	testComments();
+	testLineEndings();
+	testSplitLines();
+}
@@ -16,112 +16,779 @@
 // DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <cassert>
-#include "../src/motionController.h"
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <string>
 #include <vector>
+#include "../src/motionController.h"
+#include "simulatedMachine.h"
 
 using namespace std::chrono_literals;
 
+using TestController = MotionController<MockClock, XAxis, YAxis, ZAxis>;
+
+// Run the main loop and the step interrupt until all queued moves are done.
+// Returns the time the moves took, and optionally the period of every step event.
+template<class Controller>
+StepTimer::duration runMotion(Controller& mc, std::vector<StepTimer::duration>* periods = nullptr)
+{
+	StepTimer::duration travelTime{};
+	mc.update();
+	while (!mc.finished())
+	{
+		if (periods)
+			periods->push_back(mc.tickPeriod());
+		travelTime += mc.tickPeriod();
+		const uint64_t cycles = uint64_t(mc.tickPeriod().count()) * StepTimer::kPrescaler;
+		noInterrupts(); // Like the step interrupt
+		mc.step();
+		mc.endStepPulses();
+		interrupts();
+		sitl::spendCycles(cycles);
+		mc.update();
+	}
+	return travelTime;
+}
+
+// Endstop interrupts, wired as in main.cpp, to the controller under test
+void (*gEndstopHandlers[3])() = {};
+ISR(INT5_vect) { gEndstopHandlers[0](); }
+ISR(PCINT1_vect) { gEndstopHandlers[1](); }
+ISR(INT3_vect) { gEndstopHandlers[2](); }
+
+template<class Controller>
+void connectEndstops(Controller& mc)
+{
+	static Controller* controller;
+	controller = &mc;
+	gEndstopHandlers[0] = [] { controller->template endstopInterrupt<XAxis>(); };
+	gEndstopHandlers[1] = [] { controller->template endstopInterrupt<YAxis>(); };
+	gEndstopHandlers[2] = [] { controller->template endstopInterrupt<ZAxis>(); };
+}
+
+template<class Controller>
+void startAtHome(Controller& mc)
+{
+	connectEndstops(mc);
+	mc.start();
+	mc.goHome();
+	runMotion(mc);
+}
+
 void testStartUnknown()
 {
-	MotionController<RealTimeClock> mc;
+	TestController mc;
 	mc.start();
 	auto startPos = mc.getMotorPositions();
-	assert(startPos.x() == MotionController<RealTimeClock>::UnkownStep);
-	assert(startPos.y() == MotionController<RealTimeClock>::UnkownStep);
-	assert(startPos.z() == MotionController<RealTimeClock>::UnkownStep);
+	assert(startPos.x() == TestController::UnkownStep);
+	assert(startPos.y() == TestController::UnkownStep);
+	assert(startPos.z() == TestController::UnkownStep);
 	// Also check there is no ongoing operation on start
 	assert(mc.finished());
 }
 
 void testGoHome()
 {
-	MotionController<RealTimeClock> mc;
-	mc.start();
-	mc.goHome();
-	while (!mc.finished())
-	{
-		mc.step();
-	}
+	TestController mc;
+	startAtHome(mc);
 	auto homePos = mc.getMotorPositions();
 	assert(homePos.x() == 0);
 	assert(homePos.y() == 0);
 	assert(homePos.z() == 0);
 }
 
-void testPositiveMotionX(int32_t steps, std::chrono::milliseconds deadline)
+// Carriage positions of the simulated axes, in steps from their endstops
+size_t gSimX, gSimY, gSimZ;
+
+void testHoming()
 {
-	using clock = RealTimeClock;
-	MotionController<clock> mc;
-	mc.start();
+	const int32_t pullOffX = micrometers(kHomingPullOff).count() * kSteps_mmX.count() / 1000;
+	const int32_t pullOffY = micrometers(kHomingPullOff).count() * kSteps_mmY.count() / 1000;
+	const int32_t pullOffZ = micrometers(kHomingPullOff).count() * kSteps_mmZ.count() / 1000;
+
+	// The origin latches at the same point no matter where the carriages start
+	const int32_t starts[][3] = { { 5000, 300, 1200 }, { 17, 9000, 0 }, { -40, 0, 3 } };
+	for (const auto& start : starts)
+	{
+		sitl::simulatedAxes[gSimX].position = start[0];
+		sitl::simulatedAxes[gSimY].position = start[1];
+		sitl::simulatedAxes[gSimZ].position = start[2];
+		TestController mc;
+		startAtHome(mc);
+		assert(mc.getMotorPositions() == Vec3<MotorSteps>(0, 0, 0));
+		assert(sitl::simulatedAxes[gSimX].position == pullOffX);
+		assert(sitl::simulatedAxes[gSimY].position == pullOffY);
+		assert(sitl::simulatedAxes[gSimZ].position == pullOffZ);
+	}
+
+	// Homing again from a known position ends in the same place
+	TestController mc;
+	startAtHome(mc);
+	mc.setLinearTarget(Vec3<MotorSteps>(800, 400, 200));
+	runMotion(mc);
 	mc.goHome();
-	while (!mc.finished())
+	runMotion(mc);
+	assert(mc.getMotorPositions() == Vec3<MotorSteps>(0, 0, 0));
+	assert(sitl::simulatedAxes[gSimX].position == pullOffX);
+}
+
+void testHomingFailure()
+{
+	// The endstop is out of reach
+	sitl::simulatedAxes[gSimZ].position = int32_t(kHomingMaxTravel.count() * kSteps_mmZ.count()) + 100;
+	TestController mc;
+	startAtHome(mc);
+	assert(mc.finished());
+	assert(mc.getMotorPositions().z() == TestController::UnkownStep);
+	assert(mc.getMotorPositions().x() == TestController::UnkownStep);
+
+	// Moves on axes that didn't home are ignored
+	mc.setLinearTarget(Vec3<MotorSteps>(100, 100, 100));
+	runMotion(mc);
+	assert(mc.getMotorPositions().x() == TestController::UnkownStep);
+
+	// Homing works once the endstop is in reach
+	sitl::simulatedAxes[gSimZ].position = 1000;
+	startAtHome(mc);
+	assert(mc.getMotorPositions() == Vec3<MotorSteps>(0, 0, 0));
+}
+
+// Output for printState
+struct StringWriter : TextWriter<StringWriter>
+{
+	void write(char c) { text += c; }
+	std::string text;
+};
+
+// Reports that don't fit in the log are dropped whole, and leave room for the ones that follow
+void testSerialLog()
+{
+	SerialLog log;
+	const std::string line(40, 'x'); // 43 bytes queued, with the line end and the size
+	for (int i = 0; i < 2; ++i)
 	{
-		mc.step();
+		log.beginReport();
+		log.println(line.c_str());
+		log.println(line.c_str());
+		log.endReport();
 	}
+	assert(log.droppedReports() == 0);
+
+	// The first line of this one still fits, but the second doesn't
+	log.beginReport();
+	log.println(line.c_str());
+	log.println(line.c_str());
+	log.endReport();
+	assert(log.droppedReports() == 1);
+
+	// Lines out of reports are single line ones
+	log.println(line.c_str());
+	assert(log.droppedReports() == 1);
+	log.println(line.c_str());
+	assert(log.droppedReports() == 2);
+
+	// Lines longer than the TX buffer could never be sent
+	SerialLog longLines;
+	longLines.println(std::string(SerialLog::kMaxLine, 'x').c_str());
+	assert(longLines.droppedReports() == 1);
+	longLines.println(std::string(SerialLog::kMaxLine - 2, 'x').c_str());
+	assert(longLines.droppedReports() == 1);
+}
+
+void testHardLimit()
+{
+	const int32_t pullOffX = micrometers(kHomingPullOff).count() * kSteps_mmX.count() / 1000;
+	TestController mc;
+	startAtHome(mc);
+
+	// A short pulse on the endstop halts the move at the exact step where it happened
+	sitl::simulatedAxes[gSimX].eventAt = pullOffX + 300;
+	mc.setLinearTarget(Vec3<MotorSteps>(1000, 200, 0));
+	runMotion(mc);
+	sitl::simulatedAxes[gSimX].eventAt = sitl::SimulatedAxis::kNoEvent;
+	assert(mc.getMotorPositions().x() == 300);
+	assert(mc.getMotorPositions().y() == 60);
+	assert(sitl::simulatedAxes[gSimX].position == pullOffX + 300);
+
+	// Targets are unknown now, and the state report must not subtract them
+	StringWriter state;
+	mc.printState(state);
+	assert(state.text.find("tx:-2147483648,cx:300\r\n") == 0);
+	assert(state.text.find("ax:") == std::string::npos);
+
+	// Axes must home again before moving
+	mc.setLinearTarget(Vec3<MotorSteps>(0, 0, 0));
+	runMotion(mc);
+	assert(mc.getMotorPositions().x() == 300);
+	startAtHome(mc);
+	assert(mc.getMotorPositions() == Vec3<MotorSteps>(0, 0, 0));
+	assert(sitl::simulatedAxes[gSimX].position == pullOffX);
+	state.text.clear();
+	mc.printState(state);
+	assert(state.text.find("tx:0,cx:0,ax:0\r\n") == 0);
+
+	// Pin change interrupts catch pulses on the Y endstop too
+	sitl::simulatedAxes[gSimY].eventAt = 1000;
+	mc.setLinearTarget(Vec3<MotorSteps>(0, 2000, 0));
+	runMotion(mc);
+	sitl::simulatedAxes[gSimY].eventAt = sitl::SimulatedAxis::kNoEvent;
+	assert(sitl::simulatedAxes[gSimY].position == 1000);
+}
+
+void testPositiveMotionX(int32_t steps, std::chrono::milliseconds deadline)
+{
+	TestController mc;
+	startAtHome(mc);
 	// Move some distance along the X axis
 	const auto targetPos = Vec3<MotorSteps>(steps,0,0);
 	mc.setLinearTarget(targetPos);
-	auto t0 = clock::now();
-	while (clock::now() - t0 <= deadline+1ms)
-	{
-		if (mc.finished())
-			break;
-		mc.step();
-	}
+	auto travelTime = runMotion(mc);
+	assert(travelTime <= deadline);
 	auto finalPos = mc.getMotorPositions();
 	assert(targetPos == finalPos);
 }
 
 void testRoundTripMotion(int32_t steps, std::chrono::milliseconds deadline)
 {
-	using clock = RealTimeClock;
-	MotionController<clock> mc;
-	mc.start();
-	mc.goHome();
-	while (!mc.finished())
-	{
-		mc.step();
-	}
+	TestController mc;
+	startAtHome(mc);
 	// Move some distance along the X axis
 	const auto targetPos = Vec3<MotorSteps>(steps, 0, 0);
 	mc.setLinearTarget(targetPos);
-	auto t0 = clock::now();
-	while (clock::now() - t0 <= deadline + 1ms)
-	{
-		if (mc.finished())
-			break;
-		mc.step();
-	}
+	auto travelTime = runMotion(mc);
+	assert(travelTime <= deadline);
 	auto finalPos = mc.getMotorPositions();
 	assert(targetPos == finalPos);
 	// Retract the traveled distance
 	mc.setLinearTarget(Vec3i(0, 0, 0));
-	t0 = clock::now();
-	while (clock::now() - t0 <= deadline + 1ms)
+	travelTime = runMotion(mc);
+	assert(travelTime <= deadline);
+	finalPos = mc.getMotorPositions();
+	assert(Vec3<MotorSteps>(0,0,0) == finalPos);
+}
+
+void testDiagonalInterpolation()
+{
+	TestController mc;
+	startAtHome(mc);
+	// Three steps in X for every step in Y
+	const auto targetPos = Vec3<MotorSteps>(300, 100, 0);
+	mc.setLinearTarget(targetPos);
+	mc.update();
+	int32_t events = 0;
+	StepTimer::duration travelTime{};
+	while (!mc.finished())
+	{
+		travelTime += mc.tickPeriod();
+		mc.step();
+		mc.update();
+		++events;
+		// X steps on every event, and Y stays within half a step of the ideal line
+		auto pos = mc.getMotorPositions();
+		assert(pos.x() == events);
+		assert(abs(6 * pos.y().count() - 2 * pos.x().count()) <= 3);
+	}
+	assert(events == 300);
+	assert(targetPos == mc.getMotorPositions());
+	// Acceleration ramps can only make the move slower than the minimum time allowed
+	auto minTime = TestController::linearArcMinDuration(targetPos);
+	assert(travelTime >= minTime);
+}
+
+std::vector<sitl::PortWrite> gPortWrites;
+
+void testPortGroup()
+{
+	gPortWrites.clear();
+	sitl::portWriteObserver = [](const sitl::PortWrite& w) { gPortWrites.push_back(w); };
+	PORTF = 0;
+	PORTA = 0;
+	gPortWrites.clear();
+
+	// Two pins in port F, one in port A
+	using Group = PortGroup<MegaPin<54>, MegaPin<55>, MegaPin<26>>;
+	Group::setHigh(Group::kAll);
+	assert(gPortWrites.size() == 2);
+	assert(PORTF == 0b11);
+	assert(PORTA == (1 << 4));
+
+	// Ports without selected pins are left alone
+	gPortWrites.clear();
+	Group::setLow(0b010);
+	assert(gPortWrites.size() == 1);
+	assert(gPortWrites[0].port == 'F' && gPortWrites[0].value == 0b01);
+
+	gPortWrites.clear();
+	Group::write(0b110);
+	assert(gPortWrites.size() == 2);
+	assert(PORTF == 0b10);
+	assert(PORTA == (1 << 4));
+
+	sitl::portWriteObserver = nullptr;
+	Group::write(0);
+}
+
+void testGroupedStepPulses()
+{
+	TestController mc;
+	startAtHome(mc);
+
+	gPortWrites.clear();
+	sitl::portWriteObserver = [](const sitl::PortWrite& w) { gPortWrites.push_back(w); };
+	mc.setLinearTarget(Vec3<MotorSteps>(300, 100, 0));
+	runMotion(mc);
+	sitl::portWriteObserver = nullptr;
+
+	// Count rising edges of the X and Y step pins
+	auto risingEdges = [](char port, uint8_t mask) {
+		int edges = 0;
+		bool high = false;
+		for (auto& w : gPortWrites)
+		{
+			if (w.port != port)
+				continue;
+			const bool newHigh = w.value & mask;
+			edges += newHigh && !high;
+			high = newHigh;
+		}
+		assert(!high);
+		return edges;
+	};
+	assert(risingEdges('F', XAxisStepper::StepPin::kMask) == 300);
+	assert(risingEdges('A', YAxisStepper::StepPin::kMask) == 100);
+}
+
+// Direction changes between moves wait for the step pulses to end, without busy waiting in step()
+void testDirectionChanges()
+{
+	TestController mc;
+	startAtHome(mc);
+	mc.setLinearTarget(Vec3<MotorSteps>(200, 100, 0));
+	mc.setLinearTarget(Vec3<MotorSteps>(100, 200, 0));
+	mc.setLinearTarget(Vec3<MotorSteps>(0, 0, 0));
+
+	gPortWrites.clear();
+	sitl::portWriteObserver = [](const sitl::PortWrite& w) { gPortWrites.push_back(w); };
+	uint64_t maxStepCycles = 0;
+	mc.update();
+	while (!mc.finished())
+	{
+		const uint64_t cycles = uint64_t(mc.tickPeriod().count()) * StepTimer::kPrescaler;
+		noInterrupts();
+		const uint64_t t0 = sitl::cpuCycles();
+		mc.step();
+		if (sitl::cpuCycles() - t0 > maxStepCycles)
+			maxStepCycles = sitl::cpuCycles() - t0;
+		mc.endStepPulses();
+		interrupts();
+		sitl::spendCycles(cycles);
+		mc.update();
+	}
+	sitl::portWriteObserver = nullptr;
+
+	// Far less than waiting for a pulse width would take
+	assert(maxStepCycles < F_CPU / 1'000'000 * TestController::kStepPulseWidth.count());
+
+	// Dir pins only change while the step pin of their axis is low
+	auto dirChanges = [](char port, uint8_t stepMask, uint8_t dirMask) {
+		int changes = 0;
+		uint8_t last = 0;
+		for (auto& w : gPortWrites)
+		{
+			if (w.port != port)
+				continue;
+			if ((w.value ^ last) & dirMask)
+			{
+				assert(!(last & stepMask) && !(w.value & stepMask));
+				++changes;
+			}
+			last = w.value;
+		}
+		return changes;
+	};
+	assert(dirChanges('F', XAxisStepper::StepPin::kMask, XAxisStepper::DirPin::kMask) >= 1);
+	assert(dirChanges('A', YAxisStepper::StepPin::kMask, YAxisStepper::DirPin::kMask) >= 1);
+	assert(mc.getMotorPositions() == Vec3<MotorSteps>(0, 0, 0));
+}
+
+// Like in the middle of a move, the step interrupt leaves the pulse of the last event of a move to
+// TIMER1_COMPB_vect. The next move must not cut that pulse short, nor change directions during it.
+void testPulseAfterLastEvent()
+{
+	TestController mc;
+	startAtHome(mc);
+	mc.setLinearTarget(Vec3<MotorSteps>(100, 0, 0));
+
+	gPortWrites.clear();
+	sitl::portWriteObserver = [](const sitl::PortWrite& w) { gPortWrites.push_back(w); };
+	mc.update();
+	for (;;)
 	{
-		if (mc.finished())
+		const uint64_t cycles = uint64_t(mc.tickPeriod().count()) * StepTimer::kPrescaler;
+		noInterrupts();
+		mc.step();
+		const bool last = mc.idle();
+		if (!last)
+			mc.endStepPulses();
+		interrupts();
+		if (last)
 			break;
+		sitl::spendCycles(cycles);
+		mc.update();
+	}
+
+	// Back along X, so its direction changes
+	mc.setLinearTarget(Vec3<MotorSteps>(0, 0, 0));
+	assert(!mc.update());
+	constexpr uint64_t pulseCycles = F_CPU / 1'000'000 * XAxis::Driver::kMinPulseWidth.count();
+	sitl::spendCycles(pulseCycles);
+	noInterrupts(); // Like TIMER1_COMPB_vect
+	mc.endStepPulses();
+	interrupts();
+	assert(mc.update());
+	sitl::portWriteObserver = nullptr;
+
+	// The X step pin stays high for the whole pulse width, and only then the X dir pin changes
+	constexpr uint8_t stepMask = XAxisStepper::StepPin::kMask;
+	constexpr uint8_t dirMask = XAxisStepper::DirPin::kMask;
+	uint64_t pulseStart = 0;
+	uint64_t dirChange = 0;
+	uint8_t last = 0;
+	for (auto& w : gPortWrites)
+	{
+		if (w.port != 'F')
+			continue;
+		if (!(last & stepMask) && (w.value & stepMask))
+			pulseStart = w.cycle;
+		if ((w.value ^ last) & dirMask)
+		{
+			assert(!(w.value & stepMask));
+			dirChange = w.cycle;
+		}
+		last = w.value;
+	}
+	assert(pulseStart && dirChange);
+	assert(dirChange - pulseStart >= pulseCycles);
+	runMotion(mc);
+	assert(mc.getMotorPositions() == Vec3<MotorSteps>(0, 0, 0));
+}
+
+// Rotary axis on the E1 driver of a RAMPS board
+struct AAxis
+{
+	using Driver = StepperDriver<MegaPin<36>, MegaPin<34>, MegaPin<30>, 2>;
+	using Endstop = NoEndstop;
+	static constexpr auto kSteps_mm = kSteps_mmX; // Steps per degree
+	static constexpr auto kMaxSpeed = kMaxSpeedX;
+	static constexpr auto kMaxAccel = kMaxAccelX;
+	static constexpr auto kMaxJerk = kMaxJerkX;
+	static constexpr auto kMinStepPeriod = minStepPeriod(kMaxSpeed, kSteps_mm);
+};
+
+void testFourAxes()
+{
+	MotionController<MockClock, XAxis, YAxis, ZAxis, AAxis> mc;
+	startAtHome(mc);
+
+	gPortWrites.clear();
+	sitl::portWriteObserver = [](const sitl::PortWrite& w) { gPortWrites.push_back(w); };
+	const auto targetPos = Vector<MotorSteps, 4>(100, 0, 0, 400);
+	mc.setLinearTarget(targetPos);
+	runMotion(mc);
+	sitl::portWriteObserver = nullptr;
+	assert(mc.getMotorPositions() == targetPos);
+
+	// The fourth axis steps on its own pin, every event
+	int edges = 0;
+	bool high = false;
+	for (auto& w : gPortWrites)
+	{
+		if (w.port != 'C')
+			continue;
+		const bool newHigh = w.value & AAxis::Driver::StepPin::kMask;
+		edges += newHigh && !high;
+		high = newHigh;
+	}
+	assert(edges == 400);
+	assert(PORTC & AAxis::Driver::DirPin::kMask);
+}
+
+void testAccelerationProfile()
+{
+	TestController mc;
+	startAtHome(mc);
+	// Long enough to reach cruise speed
+	const auto targetPos = Vec3<MotorSteps>(8000, 0, 0);
+	mc.setLinearTarget(targetPos);
+	std::vector<StepTimer::duration> periods;
+	runMotion(mc, &periods);
+	assert(periods.size() == 8000);
+	assert(targetPos == mc.getMotorPositions());
+
+	// Start and end at rest
+	const auto restPeriod = StepTimer::duration(StepTimer::kFrequency / kMinStepRate);
+	assert(periods.front() == restPeriod);
+	assert(periods.back() > periods[periods.size() / 2]);
+
+	// Speed up monotonically to cruise speed, then slow down monotonically
+	auto fastest = std::min_element(periods.begin(), periods.end());
+	for (auto p = periods.begin(); p != fastest; ++p)
+		assert(*p >= *(p + 1));
+	for (auto p = fastest; p + 1 != periods.end(); ++p)
+		assert(*p <= *(p + 1));
+	auto cruisePeriod = std::chrono::duration_cast<StepTimer::duration>(XAxis::kMinStepPeriod * 1_steps);
+	assert(*fastest >= cruisePeriod - StepTimer::duration(1));
+	assert(periods[periods.size() / 2] == *fastest);
+}
+
+void testSCurveProfile()
+{
+	// Run the profile on its own, ticking it as the step engine would
+	constexpr int32_t events = 20000;
+	constexpr uint32_t cruiseRate = 8000;
+	constexpr uint32_t acceleration = 20000;
+	constexpr uint32_t jerk = 200000;
+	SCurveProfile profile;
+	profile.plan(events, kMinStepRate, cruiseRate, kMinStepRate, acceleration, jerk);
+	assert(profile.rate() == kMinStepRate);
+
+	int32_t event = 0;
+	int64_t prevAcceleration = 0;
+	uint32_t fastest = 0;
+	float eventFraction = 0;
+	while (event < events)
+	{
+		const uint32_t prevRate = profile.rate();
+		eventFraction += float(prevRate) / kAccelerationTicksPerSecond;
+		event = min(events, event + int32_t(eventFraction));
+		eventFraction -= int32_t(eventFraction);
+		profile.tick(event);
+		fastest = max(fastest, profile.rate());
+
+		// Acceleration never exceeds its limit, and only changes gradually
+		const int64_t curAcceleration = (int64_t(profile.rate()) - prevRate) * kAccelerationTicksPerSecond;
+		assert(std::llabs(curAcceleration) <= acceleration + kAccelerationTicksPerSecond);
+		assert(std::llabs(curAcceleration - prevAcceleration) <= 2 * jerk / kAccelerationTicksPerSecond + kAccelerationTicksPerSecond);
+		prevAcceleration = curAcceleration;
+	}
+	assert(fastest == cruiseRate);
+	assert(profile.rate() < kMinStepRate + jerk / kAccelerationTicksPerSecond);
+}
+
+void testMotionTables()
+{
+	// Table lookups stay close to the exact division, and fall back to it outside the table
+	constexpr uint32_t maxRate = kMaxStepRate<XAxis, YAxis, ZAxis>;
+	for (uint32_t rate = 1; rate < 2 * maxRate; ++rate)
+	{
+		const float exact = float(StepTimer::kFrequency) / rate;
+		assert(fabsf(ratePeriod<maxRate>(rate).count() - exact) < 1 + 0.001f * exact);
+		if (rate < kMinStepRate || rate > maxRate + (1 << RatePeriodTable<maxRate>::kShift))
+			assert(ratePeriod<maxRate>(rate).count() == StepTimer::kFrequency / rate);
+	}
+	assert(ratePeriod<maxRate>(kMinStepRate).count() == StepTimer::kFrequency / kMinStepRate);
+
+	// The fastest axis sets the max rate, whatever its position in the list
+	static_assert(maxRate == kMaxStepRate<ZAxis, YAxis, XAxis>);
+	static_assert(maxRate == kMaxStepRate<YAxis>);
+
+	for (uint32_t perSecond = 0; perSecond < 400'000; ++perSecond)
+	{
+		const uint32_t exact = perSecond / kAccelerationTicksPerSecond;
+		assert(perAccelerationTick(perSecond) <= exact);
+		assert(perAccelerationTick(perSecond) + 1 >= exact);
+	}
+}
+
+void testSegmentBuffer()
+{
+	TestController mc;
+	startAtHome(mc);
+	const auto targetPos = Vec3<MotorSteps>(8000, 0, 0);
+	mc.setLinearTarget(targetPos);
+
+	// A single update buffers enough segments for the step engine to keep going on its own
+	assert(mc.update());
+	StepTimer::duration bufferedTime{};
+	while (!mc.idle())
+	{
+		bufferedTime += mc.tickPeriod();
 		mc.step();
+		mc.endStepPulses();
 	}
-	finalPos = mc.getMotorPositions();
-	assert(Vec3<MotorSteps>(0,0,0) == finalPos);
+	assert(bufferedTime >= TestController::kSegmentCapacity * kAccelerationTickPeriod / 2);
+	assert(!mc.finished());
+
+	// Running out of segments only pauses the move
+	runMotion(mc);
+	assert(targetPos == mc.getMotorPositions());
+}
+
+void testLookAhead()
+{
+	const auto restPeriod = StepTimer::duration(StepTimer::kFrequency / kMinStepRate);
+	TestController mc;
+	startAtHome(mc);
+
+	// Collinear moves run as a single one, without slowing down at the junction
+	mc.setLinearTarget(Vec3<MotorSteps>(4000, 0, 0));
+	mc.setLinearTarget(Vec3<MotorSteps>(8000, 0, 0));
+	std::vector<StepTimer::duration> periods;
+	runMotion(mc, &periods);
+	assert(periods.size() == 8000);
+	auto fastest = *std::min_element(periods.begin(), periods.end());
+	assert(periods[3999] == fastest);
+	assert(periods[4000] == fastest);
+
+	// Corners slow down, but don't stop
+	mc.setLinearTarget(Vec3<MotorSteps>(8000, 1600, 0));
+	mc.setLinearTarget(Vec3<MotorSteps>(4000, 1600, 0));
+	periods.clear();
+	runMotion(mc, &periods);
+	assert(periods.size() == 1600 + 4000);
+	assert(periods[1600] < restPeriod);
+	assert(periods[1600] > fastest);
+
+	// Reversals stop completely
+	mc.setLinearTarget(Vec3<MotorSteps>(8000, 1600, 0));
+	periods.clear();
+	runMotion(mc, &periods);
+	mc.setLinearTarget(Vec3<MotorSteps>(4000, 1600, 0));
+	mc.setLinearTarget(Vec3<MotorSteps>(6000, 1600, 0));
+	periods.clear();
+	runMotion(mc, &periods);
+	assert(periods.size() == 4000 + 2000);
+	assert(periods[4000] == restPeriod);
+	assert(mc.getMotorPositions() == Vec3<MotorSteps>(6000, 1600, 0));
+}
+
+void testFeedRate()
+{
+	TestController mc;
+	startAtHome(mc);
+	// 50mm along Y, which can move at 50mm/s
+	const auto far = Vec3<MotorSteps>(0, int32_t(50 * kSteps_mmY.count()), 0);
+	const auto home = Vec3<MotorSteps>(0, 0, 0);
+
+	mc.setLinearTarget(far, TestController::kRapidFeed);
+	const auto rapidTime = runMotion(mc);
+	assert(rapidTime >= 1s && rapidTime < 1300ms);
+
+	// 20mm/s
+	mc.setLinearTarget(home, um_second(20'000));
+	const auto feedTime = runMotion(mc);
+	assert(feedTime >= 2500ms && feedTime < 2700ms);
+	assert(mc.getMotorPositions() == home);
+
+	// Feed rates are clamped to the max speed of the axes
+	mc.setLinearTarget(far, um_second(100'000));
+	assert(runMotion(mc) <= rapidTime);
+}
+
+void testArcGenerator()
+{
+	constexpr float tolerance = 0.01f;
+	ArcGenerator arc;
+
+	// Counterclockwise quarter circle of radius 10mm
+	const float start[3] = { 10, 0, 0 };
+	const float end[3] = { 0, 10, 0 };
+	const float center[2] = { 0, 0 };
+	arc.start(start, end, center, ArcPlane::xy, false, tolerance);
+	float prev[3] = { start[0], start[1], start[2] };
+	int chords = 0;
+	while (arc.active())
+	{
+		float pos[3];
+		arc.next(pos);
+		++chords;
+		assert(fabsf(hypotf(pos[0], pos[1]) - 10) < 1e-4f);
+		assert(pos[1] > prev[1]);
+		// The middle of the chord is the furthest point from the arc
+		const float midRadius = hypotf(0.5f * (pos[0] + prev[0]), 0.5f * (pos[1] + prev[1]));
+		assert(10 - midRadius <= tolerance);
+		for (int i = 0; i < 3; ++i)
+			prev[i] = pos[i];
+	}
+	assert(chords == int(ceilf(0.5f * float(M_PI) / (2 * acosf(1 - tolerance / 10)))));
+	assert(prev[0] == end[0] && prev[1] == end[1]);
+
+	// Clockwise full helix on the YZ plane
+	const float helixStart[3] = { 3, 10, 0 };
+	const float helixEnd[3] = { 2, 10, 0 };
+	const float helixCenter[2] = { 0, 0 };
+	arc.start(helixStart, helixEnd, helixCenter, ArcPlane::yz, true, tolerance);
+	float pos[3];
+	arc.next(pos);
+	assert(pos[0] > 2 && pos[0] < 3);
+	assert(pos[2] < 0); // Clockwise from the positive end of X
+	while (arc.active())
+		arc.next(pos);
+	assert(pos[0] == 2 && pos[1] == 10 && pos[2] == 0);
+}
+
+void testArcMove()
+{
+	TestController mc;
+	startAtHome(mc);
+	const float steps_mm[3] = { float(kSteps_mmX.count()), float(kSteps_mmY.count()), float(kSteps_mmZ.count()) };
+	const auto startPos = Vec3<MotorSteps>(int32_t(10 * steps_mm[0]), int32_t(10 * steps_mm[1]), 0);
+	mc.setLinearTarget(startPos);
+	runMotion(mc);
+
+	// Full circle of radius 5mm. More chords than the planner can take, so they are queued as it makes room.
+	const float center[2] = { 5, 10 };
+	mc.setArcTarget(startPos, center, ArcPlane::xy, true);
+	assert(mc.full());
+
+	mc.update();
+	float maxError = 0;
+	while (!mc.finished())
+	{
+		mc.step();
+		mc.endStepPulses();
+		mc.update();
+		const auto& pos = mc.getMotorPositions();
+		const float radius = hypotf(pos.x().count() / steps_mm[0] - center[0], pos.y().count() / steps_mm[1] - center[1]);
+		maxError = max(maxError, fabsf(radius - 5));
+	}
+	assert(maxError < kArcTolerance.count() / 1000.f + 2 / steps_mm[1]);
+	assert(mc.getMotorPositions() == startPos);
 }
 
 int main()
 {
-	//testStartUnknown();
-	//testGoHome();
-	// Initialize the real time clock for time sensitive tests
-	RealTimeClock::now();
+	gSimX = sitl::simulateAxis<XAxis>(1000);
+	gSimY = sitl::simulateAxis<YAxis>(1000);
+	gSimZ = sitl::simulateAxis<ZAxis>(1000);
+
+	testStartUnknown();
+	testGoHome();
+	testHoming();
+	testHomingFailure();
+	testSerialLog();
+	testHardLimit();
 	testPositiveMotionX(1, 10ms);
 	testPositiveMotionX(100, 1001ms);
-	testPositiveMotionX(80000, 10'001ms);
+	testPositiveMotionX(80000, 20'200ms);
 
 	testRoundTripMotion(100, 1001ms);
 	testRoundTripMotion(8000, 10'001ms);
-	// Initialize the mock clock
-	MockClockSrc::currentTime = MockClockSrc::time_point(1ms);
-	MockClockSrc::now();
-	// TODO Mock time tests
-}
\ No newline at end of file
+
+	testDiagonalInterpolation();
+	testPortGroup();
+	testGroupedStepPulses();
+	testDirectionChanges();
+	testPulseAfterLastEvent();
+	testFourAxes();
+	testAccelerationProfile();
+	testSCurveProfile();
+	testMotionTables();
+	testSegmentBuffer();
+	testLookAhead();
+	testFeedRate();
+	testArcGenerator();
+	testArcMove();
+}